@@ -29,7 +29,8 @@ enum ColorPair {
   pairWhiteBlue= 1,
   pairWhiteBlack,
   pairRedBlue,
-  pairYellowBlue
+  pairYellowBlue,
+  pairWhiteRed
 };
 
 static const ColorPair colorStyle[] = {
@@ -41,7 +42,8 @@ static const ColorPair colorStyle[] = {
   pairWhiteBlack,  // cFileName
   pairWhiteBlue,   // cFileWin
   pairRedBlue,     // cFileDiff
-  pairYellowBlue   // cFileEdit
+  pairYellowBlue,  // cFileEdit
+  pairWhiteRed     // cFileBad
 };
 
 static const attr_t attribStyle[] = {
@@ -53,7 +55,8 @@ static const attr_t attribStyle[] = {
   A_REVERSE | COLOR_PAIR(colorStyle[ cFileName   ]),
               COLOR_PAIR(colorStyle[ cFileWin    ]),
   A_BOLD    | COLOR_PAIR(colorStyle[ cFileDiff   ]),
-  A_BOLD    | COLOR_PAIR(colorStyle[ cFileEdit   ])
+  A_BOLD    | COLOR_PAIR(colorStyle[ cFileEdit   ]),
+  A_BOLD    | COLOR_PAIR(colorStyle[ cFileBad    ])
 };
 
 //====================================================================
@@ -87,6 +90,7 @@ bool ConWindow::startup()
     init_pair(pairWhiteBlack, COLOR_WHITE,  COLOR_BLACK);
     init_pair(pairRedBlue,    COLOR_RED,    COLOR_BLUE);
     init_pair(pairYellowBlue, COLOR_YELLOW, COLOR_BLUE);
+    init_pair(pairWhiteRed,   COLOR_WHITE,  COLOR_RED);
   } // end if terminal has color
 
   return true;
@@ -40,7 +40,8 @@ enum Style {
   cFileName,
   cFileWin,
   cFileDiff,
-  cFileEdit
+  cFileEdit,
+  cFileBad
 };
 
 class ConWindow
@@ -25,7 +25,27 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <limits>
+#include <new>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#ifdef HAVE_PROCESS_VM_READV
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 
 typedef int      File;
 typedef off_t    FPos;
@@ -37,6 +57,18 @@ const int
 
 const File InvalidFile = -1;
 
+typedef pid_t    Process;
+
+const Process InvalidProcess = -1;
+
+typedef FILE*    MemoryMap;     // The list of a process's regions
+
+// Buffers used with OpenFileDirect must be aligned to this:
+const Size DirectAlignment = 4096;
+
+// Hints for AdviseFile and AdviseMapping:
+enum Advice { AdviseNormal, AdviseSequential, AdviseDontNeed };
+
 //--------------------------------------------------------------------
 inline const char* ErrorMsg()
 {
@@ -49,6 +81,106 @@ inline File OpenFile(const char* path, bool writable=false)
   return open(path, (writable ? O_RDWR : O_RDONLY));
 } // end OpenFile
 
+//--------------------------------------------------------------------
+// Open a file for reading without going through the OS cache:
+//
+// Reads must use buffers, positions and sizes that are multiples of
+// DirectAlignment.  Returns InvalidFile if the system or filesystem
+// doesn't support uncached I/O.
+
+#ifdef O_DIRECT
+inline File OpenFileDirect(const char* path)
+{
+  return open(path, O_RDONLY | O_DIRECT);
+} // end OpenFileDirect
+#else
+inline File OpenFileDirect(const char*)
+{
+  errno = EINVAL;
+  return InvalidFile;
+} // end OpenFileDirect
+#endif
+
+//--------------------------------------------------------------------
+// Take over standard input as a file to display:
+//
+// The terminal is reopened as standard input so that curses can still
+// read the keyboard.  Must be called before ConWindow::startup.
+//
+// Returns:
+//   A new handle for the original standard input, or InvalidFile
+
+inline File OpenStdin()
+{
+  File  tty = open("/dev/tty", O_RDONLY);
+  if (tty == InvalidFile) return InvalidFile;
+
+  File  file = dup(STDIN_FILENO);
+
+  if (file != InvalidFile && dup2(tty, STDIN_FILENO) < 0) {
+    close(file);
+    file = InvalidFile;
+  }
+
+  close(tty);
+  return file;
+} // end OpenStdin
+
+//--------------------------------------------------------------------
+// Create an anonymous temporary file:
+//
+// The file is deleted when it's closed.
+
+inline File OpenTempFile()
+{
+  const char*  dir = getenv("TMPDIR");
+  char         path[4096];
+
+  snprintf(path, sizeof(path), "%s/vbindiffXXXXXX",
+           ((dir && *dir) ? dir : "/tmp"));
+
+  File  file = mkstemp(path);
+  if (file != InvalidFile) unlink(path);
+
+  return file;
+} // end OpenTempFile
+
+//--------------------------------------------------------------------
+// Create a file for writing:
+//
+// Input:
+//   path:       The file to create
+//   exclusive:  If true, fail if the file (or a symlink) already
+//               exists, and make the new file private until you call
+//               CopyFileMode.  Otherwise, replace any existing file.
+
+inline File OpenNewFile(const char* path, bool exclusive=false)
+{
+  return (exclusive ? open(path, O_WRONLY | O_CREAT | O_EXCL, 0600)
+                    : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+} // end OpenNewFile
+
+//--------------------------------------------------------------------
+// Find out whether OpenNewFile failed because the file exists:
+
+inline bool FileExisted()
+{
+  return (errno == EEXIST);
+} // end FileExisted
+
+//--------------------------------------------------------------------
+// Give a file the same permissions as another:
+//
+// If that isn't possible, to is left as it was.
+
+inline void CopyFileMode(File from, File to)
+{
+  struct stat  info;
+
+  if (fstat(from, &info) == 0)
+    fchmod(to, info.st_mode & 0777);
+} // end CopyFileMode
+
 //--------------------------------------------------------------------
 inline void CloseFile(File file)
 {
@@ -88,6 +220,539 @@ inline FPos SeekFile(File file, FPos position, int whence=SeekPos)
   return lseek(file, position, whence);
 } // end SeekFile
 
+//--------------------------------------------------------------------
+// Read from a specific position:
+//
+// Unlike SeekFile+ReadFile, this doesn't use the file's current
+// position, so several threads can read the same file at once.
+// A pipe has no position, so for a pipe this just reads the next
+// data available.
+
+inline Size ReadFileAt(File file, FPos position, void* buffer, Size count)
+{
+  Size  bytesRead;
+
+  while ((bytesRead = pread(file, buffer, count, position)) < 0 &&
+         errno == EINTR)
+    ;
+
+  if (bytesRead < 0 && errno == ESPIPE)
+    bytesRead = read(file, buffer, count);
+
+  return bytesRead;
+} // end ReadFileAt
+
+//--------------------------------------------------------------------
+// Write to a specific position:
+//
+// Like ReadFileAt, this doesn't use the file's current position.
+
+bool WriteFileAt(File file, FPos position, const void* buffer, Size count)
+{
+  const char* ptr = reinterpret_cast<const char*>(buffer);
+
+  while (count > 0) {
+    Size bytesWritten = pwrite(file, ptr, count, position);
+    if (bytesWritten < 1) {
+      if (errno == EINTR)
+        bytesWritten = 0;
+      else
+        return false;
+    }
+
+    ptr      += bytesWritten;
+    position += bytesWritten;
+    count    -= bytesWritten;
+  } // end while more to write
+
+  return true;
+} // end WriteFileAt
+
+//--------------------------------------------------------------------
+// Make one file a copy-on-write clone of another:
+//
+// The two files share their disk blocks until one of them is changed,
+// so this is nearly instant no matter how big the file is.
+//
+// Returns:
+//   false if the filesystem can't do it (the caller should copy the
+//   data instead)
+
+#ifdef FICLONE
+inline bool CloneFile(File from, File to)
+{
+  return (ioctl(to, FICLONE, from) == 0);
+} // end CloneFile
+#else
+inline bool CloneFile(File, File)
+{
+  return false;
+} // end CloneFile
+#endif
+
+//--------------------------------------------------------------------
+// Copy part of one file into another:
+//
+// Where possible, the kernel copies the data without passing it
+// through our address space (and some filesystems share the blocks
+// instead of copying them).
+//
+// Returns:
+//   The number of bytes copied (0 at EOF), or -1 on error
+
+Size CopyFileRange(File from, FPos fromPos, File to, FPos toPos, Size count)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t  in = fromPos, out = toPos;
+  Size    copied;
+
+  while ((copied = copy_file_range(from, &in, to, &out, count, 0)) < 0 &&
+         errno == EINTR)
+    ;
+
+  // Fall back to read & write if the kernel can't copy these files:
+  if (copied >= 0 || (errno != EXDEV && errno != EINVAL &&
+                      errno != ENOSYS && errno != EOPNOTSUPP))
+    return copied;
+#endif
+
+  char  buf[65536];
+
+  if (count > Size(sizeof(buf))) count = sizeof(buf);
+
+  Size  bytesRead = ReadFileAt(from, fromPos, buf, count);
+
+  if (bytesRead > 0 && !WriteFileAt(to, toPos, buf, bytesRead))
+    return -1;
+
+  return bytesRead;
+} // end CopyFileRange
+
+//--------------------------------------------------------------------
+// Check whether we can read a file in any order:
+//
+// Returns false for pipes, sockets, and terminals.
+
+inline bool IsSeekable(File file)
+{
+  return (lseek(file, 0, SEEK_CUR) >= 0);
+} // end IsSeekable
+
+//--------------------------------------------------------------------
+// Get the size of a file:
+//
+// Returns:
+//   The file size, or -1 if it can't be determined
+
+inline FPos FileSize(File file)
+{
+  struct stat  st;
+
+  if (fstat(file, &st) == 0 && S_ISREG(st.st_mode))
+    return st.st_size;
+
+  // Devices report a size of 0, but can usually seek to their end:
+  return lseek(file, 0, SEEK_END);
+} // end FileSize
+
+//--------------------------------------------------------------------
+// Find out whether a position is in a hole in a sparse file:
+//
+// A hole reads as zeros, but takes up no space on disk.
+//
+// Input:
+//   pos:  The position to check
+//
+// Output:
+//   end:
+//     If pos is in a hole, the position where the hole ends
+//     Otherwise, the position where the data ends,
+//     or -1 if the OS can't tell us
+//
+// Returns:
+//   true:   pos is in a hole
+//   false:  pos is in data, past EOF, or holes aren't supported
+
+#ifdef SEEK_HOLE
+inline bool FindHole(File file, FPos pos, FPos& end)
+{
+  const FPos  data = lseek(file, pos, SEEK_DATA);
+
+  if (data < 0) {
+    if (errno != ENXIO) {
+      end = -1;
+      return false;             // Not supported
+    }
+    end = FileSize(file);       // The rest of the file is a hole
+    return (end > pos);
+  }
+
+  if (data > pos) {
+    end = data;
+    return true;
+  }
+
+  end = lseek(file, pos, SEEK_HOLE);
+
+  return false;
+} // end FindHole
+#else
+inline bool FindHole(File, FPos, FPos& end)
+{
+  end = -1;
+
+  return false;
+} // end FindHole
+#endif
+
+//--------------------------------------------------------------------
+// Map an entire file into memory for reading:
+//
+// Only regular files can be mapped.  Pipes, devices, empty files and
+// files too large for the address space return NULL, and the caller
+// should fall back to ReadFile.
+//
+// Output:
+//   size:  The number of bytes mapped
+
+inline const void* MapFile(File file, FPos& size)
+{
+  struct stat  st;
+
+  if (fstat(file, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      FPos(size_t(st.st_size)) != st.st_size)
+    return NULL;
+
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+  if (p == MAP_FAILED) return NULL;
+
+  size = st.st_size;
+  return p;
+} // end MapFile
+
+//--------------------------------------------------------------------
+inline void UnmapFile(const void* address, FPos size)
+{
+  munmap(const_cast<void*>(address), size);
+} // end UnmapFile
+
+//--------------------------------------------------------------------
+// Get the time a file was last modified:
+//
+// Returns:
+//   The modification time (in arbitrary units), or -1 on error
+
+inline FPos FileModTime(File file)
+{
+  struct stat  st;
+
+  if (fstat(file, &st)) return -1;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  return FPos(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+  return FPos(st.st_mtime);
+#endif
+} // end FileModTime
+
+//--------------------------------------------------------------------
+// Get the time a file's contents or attributes last changed:
+//
+// Unlike the modification time, this can't be set back.
+//
+// Returns:
+//   The change time (in arbitrary units), or -1 on error
+
+inline FPos FileChangeTime(File file)
+{
+  struct stat  st;
+
+  if (fstat(file, &st)) return -1;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  return FPos(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+#else
+  return FPos(st.st_ctime);
+#endif
+} // end FileChangeTime
+
+//--------------------------------------------------------------------
+// Identify a file:
+//
+// Output:
+//   device:  The device the file is on
+//   inode:   The file's inode number on that device
+//
+// Returns:
+//   true if the file could be identified
+
+inline bool FileId(File file, FPos& device, FPos& inode)
+{
+  struct stat  st;
+
+  if (fstat(file, &st)) return false;
+
+  device = FPos(st.st_dev);
+  inode  = FPos(st.st_ino);
+
+  return true;
+} // end FileId
+
+//--------------------------------------------------------------------
+// Allocate a buffer suitable for a file opened with OpenFileDirect:
+
+inline void* AllocBuffer(Size size)
+{
+  void*  p;
+
+  if (posix_memalign(&p, DirectAlignment, size)) throw std::bad_alloc();
+
+  return p;
+} // end AllocBuffer
+
+//--------------------------------------------------------------------
+inline void FreeBuffer(void* buffer)
+{
+  free(buffer);
+} // end FreeBuffer
+
+//--------------------------------------------------------------------
+// Tell the OS how we're going to use part of a file:
+//
+// This is only a hint, so errors are ignored.
+//
+// Input:
+//   length:  The number of bytes (0 means through the end of the file)
+
+#ifdef POSIX_FADV_NORMAL
+inline void AdviseFile(File file, FPos position, FPos length, Advice advice)
+{
+  posix_fadvise(file, position, length,
+                ((advice == AdviseSequential) ? POSIX_FADV_SEQUENTIAL :
+                 (advice == AdviseDontNeed)   ? POSIX_FADV_DONTNEED
+                                              : POSIX_FADV_NORMAL));
+} // end AdviseFile
+#else
+inline void AdviseFile(File, FPos, FPos, Advice)
+{
+} // end AdviseFile
+#endif
+
+//--------------------------------------------------------------------
+// Tell the OS how we're going to use part of a mapping:
+//
+// AdviseDontNeed also releases our hold on those pages, so that
+// AdviseFile can then drop them from the cache.
+
+inline void AdviseMapping(const void* address, FPos length, Advice advice)
+{
+  const size_t  page = sysconf(_SC_PAGESIZE);
+  const size_t  skew = reinterpret_cast<size_t>(address) % page;
+
+  madvise(const_cast<char*>(static_cast<const char*>(address)) - skew,
+          length + skew,
+          ((advice == AdviseSequential) ? MADV_SEQUENTIAL :
+           (advice == AdviseDontNeed)   ? MADV_DONTNEED
+                                        : MADV_NORMAL));
+} // end AdviseMapping
+
+//--------------------------------------------------------------------
+// Start listing the readable regions of another process's memory:
+//
+// Output:
+//   map:  Pass this to NextMemoryRegion, then to CloseMemoryMap
+//
+// Returns:
+//   false if the list couldn't be read (call ErrorMsg for the reason)
+
+inline bool OpenMemoryMap(Process process, MemoryMap& map)
+{
+  char  path[64];
+
+  snprintf(path, sizeof(path), "/proc/%ld/maps", long(process));
+
+  map = fopen(path, "r");
+
+  return (map != NULL);
+} // end OpenMemoryMap
+
+//--------------------------------------------------------------------
+inline void CloseMemoryMap(MemoryMap map)
+{
+  fclose(map);
+} // end CloseMemoryMap
+
+//--------------------------------------------------------------------
+// Find the next readable region of another process's memory:
+//
+// Regions are returned in order of address.  A region that ends past
+// the largest FPos (like [vsyscall] at the top of a 64-bit address
+// space) is skipped, since its addresses can't be positions.
+//
+// Output:
+//   start, end:  The region found
+//
+// Returns:
+//   false if there are no more readable regions
+
+bool NextMemoryRegion(MemoryMap& map, FPos& start, FPos& end)
+{
+  const unsigned long long  maxPos = std::numeric_limits<FPos>::max();
+
+  unsigned long long  lo, hi;
+  char                perms[8];
+
+  // Each line is "start-end perms offset device inode name":
+  while (fscanf(map, "%llx-%llx %7s%*[^\n]", &lo, &hi, perms) == 3) {
+    if (perms[0] == 'r' && hi <= maxPos) {
+      start = FPos(lo);
+      end   = FPos(hi);
+      return true;
+    }
+  } // end while more regions
+
+  return false;
+} // end NextMemoryRegion
+
+//--------------------------------------------------------------------
+// Read another process's memory:
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size ReadProcessAt(Process process, FPos address, void* buffer, Size count)
+{
+#ifdef HAVE_PROCESS_VM_READV
+  struct iovec  local, remote;
+
+  local.iov_base  = buffer;
+  local.iov_len   = count;
+  remote.iov_base = reinterpret_cast<void*>(address);
+  remote.iov_len  = count;
+
+  return process_vm_readv(process, &local, 1, &remote, 1, 0);
+#else
+  char  path[64];
+
+  snprintf(path, sizeof(path), "/proc/%ld/mem", long(process));
+
+  File  mem = open(path, O_RDONLY);
+  if (mem == InvalidFile) return -1;
+
+  const Size  bytesRead = ReadFileAt(mem, address, buffer, count);
+  close(mem);
+
+  return bytesRead;
+#endif
+} // end ReadProcessAt
+
+//--------------------------------------------------------------------
+// Get ready to read another process's memory:
+//
+// Being able to list its regions doesn't mean we can read them
+// (ptrace restrictions apply only to reading), so we try reading the
+// first byte of its first readable region.
+//
+// Returns:
+//   The process, or InvalidProcess if it doesn't exist or we aren't
+//   allowed to look at it (call ErrorMsg for the reason)
+
+inline Process OpenProcessMemory(long pid)
+{
+  MemoryMap  map;
+
+  if (!OpenMemoryMap(Process(pid), map)) return InvalidProcess;
+
+  FPos  start, end;
+  char  probe;
+  bool  readable = true;
+
+  if (NextMemoryRegion(map, start, end)) {
+    const Size  bytesRead = ReadProcessAt(Process(pid), start, &probe, 1);
+
+    if (bytesRead == 0) errno = EIO;
+    readable = (bytesRead == 1);
+  } // end if it has a readable region
+
+  const int  error = errno;
+  CloseMemoryMap(map);
+  errno = error;
+
+  return (readable ? Process(pid) : InvalidProcess);
+} // end OpenProcessMemory
+
+//--------------------------------------------------------------------
+inline void CloseProcessMemory(Process)
+{
+} // end CloseProcessMemory
+
+#ifdef HAVE_LIBURING
+//--------------------------------------------------------------------
+// A queue of asynchronous reads using io_uring:
+//
+// Reads are queued with submit, handed to the kernel together by the
+// next call to wait, and completed in whatever order the device
+// finishes them.  If the kernel doesn't support io_uring, ok()
+// returns false and the caller should read synchronously instead.
+
+class ReadQueue
+{
+ protected:
+  struct io_uring  ring;
+  bool             ready;
+
+ public:
+  ReadQueue(unsigned depth)
+    : ready(io_uring_queue_init(depth, &ring, 0) == 0) {};
+  ~ReadQueue() { if (ready) io_uring_queue_exit(&ring); };
+
+  bool  ok() const { return ready; };
+
+  //------------------------------------------------------------------
+  // Queue a read:
+  //
+  // Returns false if the queue is full.
+
+  bool submit(File file, FPos position, void* buffer, Size count, void* tag)
+  {
+    struct io_uring_sqe*  sqe = io_uring_get_sqe(&ring);
+    if (!sqe) return false;
+
+    io_uring_prep_read(sqe, file, buffer, count, position);
+    io_uring_sqe_set_data(sqe, tag);
+
+    return true;
+  } // end submit
+
+  //------------------------------------------------------------------
+  // Wait for a read to complete:
+  //
+  // Output:
+  //   result:  The number of bytes read, or -1 on error
+  //
+  // Returns:
+  //   The tag passed to submit, or NULL if waiting failed
+
+  void* wait(Size& result)
+  {
+    struct io_uring_cqe*  cqe;
+
+    io_uring_submit(&ring);
+
+    int  err;
+    while ((err = io_uring_wait_cqe(&ring, &cqe)) == -EINTR)
+      ;
+    if (err < 0) return NULL;
+
+    void*  tag = io_uring_cqe_get_data(cqe);
+    result = ((cqe->res < 0) ? -1 : cqe->res);
+    io_uring_cqe_seen(&ring, cqe);
+
+    return tag;
+  } // end wait
+}; // end ReadQueue
+#endif // HAVE_LIBURING
+
 #endif // INCLUDED_FILEIO_HPP
 
 // Local Variables:
@@ -23,14 +23,21 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <mutex>
 #include <sstream>
 #include <map>
 #include <string>
+#include <thread>
 #include <vector>
 using namespace std;
 
@@ -39,6 +46,26 @@ using namespace std;
 #include "ConWin.hpp"
 #include "FileIO.hpp"
 
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+// Compare memory with the widest vectors the compiler allows:
+#if defined(__AVX2__)
+# define HAVE_AVX2 1
+# include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+      (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define HAVE_SSE2 1
+# include <emmintrin.h>
+#endif
+#if defined(_MSC_VER) && !defined(__GNUC__)
+# include <intrin.h>
+#endif
+
 const char titleString[] =
   "\nVBinDiff " PACKAGE_VERSION "\nCopyright 1995-2017 Christopher J. Madsen";
 
@@ -55,6 +82,8 @@ typedef Byte  Command;
 
 enum LockState { lockNeither = 0, lockTop, lockBottom };
 
+enum IOPolicy { ioNormal = 0, ioSequential, ioDirect };
+
 //--------------------------------------------------------------------
 // Strings:
 
@@ -81,6 +110,14 @@ typedef StrMap::value_type      SMVal;
 typedef StrMap::iterator        SMItr;
 typedef StrMap::const_iterator  SMConstItr;
 
+typedef map<FPos, Byte>         EditMap;
+typedef EditMap::iterator       EditItr;
+typedef EditMap::const_iterator EditConstItr;
+
+typedef map<FPos, FPos>         BadMap; // Start -> end of unreadable data
+typedef BadMap::iterator        BadItr;
+typedef BadMap::const_iterator  BadConstItr;
+
 //====================================================================
 // Constants:
 
@@ -107,26 +144,49 @@ const Command  cmgGotoMask    = ~cmgGotoBoth;
 const Command  cmNothing      = 0;
 const Command  cmNextDiff     = 1;
 const Command  cmQuit         = 2;
+const Command  cmPrevDiff     = 3;
 const Command  cmEditTop      = 8;
 const Command  cmEditBottom   = 9;
 const Command  cmUseTop       = 10;
 const Command  cmUseBottom    = 11;
 const Command  cmToggleASCII  = 12;
+const Command  cmUndo         = 13;
+const Command  cmRedo         = 14;
+const Command  cmSave         = 15;
 const Command  cmFind         = 16; // Commands 16-19
-
-const short  leftMar  = 11;     // Starting column of hex display
-const short  leftMar2 = 61;     // Starting column of ASCII display
+const Command  cmRange        = 20; // Commands 20-23
 
 const int  lineWidth = 16;      // Number of bytes displayed per line
 
-const int  promptHeight = 4;    // Height of prompt window
-const int  inWidth = 10;        // Width of input window (excluding border)
+const int  minOffsetDigits = 8; // Hex digits in the offset column
+const int  maxOffsetDigits = 12; // (the most that fit in screenWidth)
+
+const int  promptHeight = 5;    // Height of prompt window
+const int  inWidth = 18;        // Width of input window (excluding border)
 const int  screenWidth = 80;
 
 const int  maxPath = 260;
 
 const VecSize maxHistory = 2000;
 
+const int  cacheBlockSize = 64 * 1024; // Size of each BlockCache block
+const int  readaheadSize  = 8 * 1024 * 1024; // How far Readahead reads ahead
+const int  readQueueDepth = 16; // Reads Readahead keeps in flight (io_uring)
+
+const int  checkpointSpan = 4 * 1024 * 1024; // Min distance between
+                                             // CompressedSource checkpoints
+const char indexSuffix[] = ".vbindex"; // Appended to compressed file names
+
+const int  copyChunk = 8 * 1024 * 1024; // How much to copy at once
+
+const int  sectorSize = 512;    // Smallest read to retry after an error
+const int  memPageSize = 4096;  // Smallest unreadable unit of a process
+
+const int  scanBlockSize = 1024 * 1024; // How much DiffIndex compares at once
+const int  maxDiffRanges = 1024 * 1024; // Most differences DiffIndex records
+const char hashSuffix[] = ".vbhash"; // Appended to HashTree cache file names
+const char backupSuffix[] = "~"; // Appended to the names of backup files
+
 const char hexDigits[] = "0123456789ABCDEF";
 
 #include "tables.h"             // ASCII and EBCDIC tables
@@ -134,10 +194,14 @@ const char hexDigits[] = "0123456789ABCDEF";
 //====================================================================
 // Class Declarations:
 
+bool askYesNo(const char* question);
 void showEditPrompt();
 void showPrompt();
 
 class Difference;
+class DiffIndex;
+class FileDisplay;
+class HashTree;
 
 union FileBuffer
 {
@@ -145,17 +209,342 @@ union FileBuffer
   Byte  buffer[lineWidth];
 }; // end FileBuffer
 
+struct Change                   // One byte changed by editing
+{
+  FileDisplay*  file;
+  FPos          pos;
+  short         before;         // -1 means the byte in the file
+  short         after;
+}; // end Change
+
+typedef vector<Change>  ChangeVec;
+
+class BadRanges                 // Data that couldn't be read
+{
+ protected:
+  BadMap  bad;
+  mutex   lock;                 // Held while using bad
+ public:
+  void  add(FPos start, FPos end);
+  bool  find(FPos pos, FPos& start, FPos& end);
+}; // end BadRanges
+
+class DataSource
+{
+ public:
+  virtual ~DataSource() {};
+  virtual bool  findBad(FPos pos, FPos& start, FPos& end);
+  virtual bool  findHole(FPos pos, FPos& end);
+  virtual bool  isPlainFile() const { return false; };
+  virtual bool  isVolatile() const { return false; };
+  virtual Size  read(FPos pos, Byte* buffer, Size count) = 0;
+  virtual FPos  size() = 0;
+}; // end DataSource
+
+class FileSource : public DataSource
+{
+ protected:
+  File       file;
+  BadRanges  bad;
+ public:
+  FileSource(File aFile) : file(aFile) {};
+  virtual bool  findBad(FPos pos, FPos& start, FPos& end)
+    { return bad.find(pos, start, end); };
+  virtual bool  findHole(FPos pos, FPos& end)
+    { return FindHole(file, pos, end); };
+  virtual bool  isPlainFile() const { return true; };
+  virtual Size  read(FPos pos, Byte* buffer, Size count);
+  virtual FPos  size() { return FileSize(file); };
+ protected:
+  Size  salvage(FPos pos, Byte* buffer, Size count);
+}; // end FileSource
+
+class CompressedSource : public DataSource
+{
+ protected:
+  struct Checkpoint
+  {
+    FPos          out;          // Uncompressed position
+    FPos          in;           // Compressed position
+    int           bits;         // Bits of the byte before in still unused
+    vector<Byte>  window;       // Output preceding out (gzip only)
+  }; // end Checkpoint
+
+  typedef vector<Checkpoint>  PointVec;
+
+  PointVec     points;
+  File         file;
+  String       indexName;
+  char         format;
+  const Byte*  piece;
+  Size         pieceLength;
+  FPos         outPos;
+  FPos         span;
+  FPos         total;
+  bool         active;
+  bool         dirty;
+  mutex        lock;
+ public:
+  CompressedSource(File aFile, const char* aFileName, char aFormat);
+  virtual ~CompressedSource();
+  virtual Size  read(FPos pos, Byte* buffer, Size count);
+  virtual FPos  size();
+ protected:
+  void  addPoint(FPos out, FPos in, int bits, const Byte* window, Size length);
+  bool  advance();
+  bool  loadIndex();
+  void  saveIndex();
+  bool  seek(FPos pos);
+  virtual Size  produce(const Byte*& data) = 0;
+  virtual bool  restart(const Checkpoint* point) = 0;
+}; // end CompressedSource
+
+#ifdef HAVE_LIBZ
+class GzipSource : public CompressedSource
+{
+ protected:
+  enum { windowSize = 32768, inputSize = 65536 };
+
+  z_stream  strm;
+  FPos      inPos;
+  Size      have;
+  Size      windowFill;
+  int       skip;
+  bool      finished;
+  bool      memberDone;
+  bool      raw;
+  Byte      window[windowSize];
+  Byte      input[inputSize];
+ public:
+  GzipSource(File aFile, const char* aFileName);
+  virtual ~GzipSource();
+ protected:
+  bool  fillInput();
+  virtual Size  produce(const Byte*& data);
+  virtual bool  restart(const Checkpoint* point);
+}; // end GzipSource
+#endif // HAVE_LIBZ
+
+#ifdef HAVE_LIBZSTD
+class ZstdSource : public CompressedSource
+{
+ protected:
+  ZSTD_DStream*   dstream;
+  ZSTD_inBuffer   in;
+  FPos            inPos;
+  bool            boundary;
+  bool            finished;
+  vector<Byte>    input;
+  vector<Byte>    output;
+ public:
+  ZstdSource(File aFile, const char* aFileName);
+  virtual ~ZstdSource();
+ protected:
+  bool  fillInput();
+  void  loadSeekTable();
+  virtual Size  produce(const Byte*& data);
+  virtual bool  restart(const Checkpoint* point);
+}; // end ZstdSource
+#endif // HAVE_LIBZSTD
+
+class SplitSource : public DataSource
+{
+ protected:
+  struct Segment
+  {
+    File  file;
+    FPos  start;                // Position of the segment's first byte
+    FPos  size;
+  }; // end Segment
+
+  typedef vector<Segment>  SegmentVec;
+
+  SegmentVec  segments;
+ public:
+  SplitSource(File aFile);
+  virtual ~SplitSource();
+  void          add(File aFile);
+  int           count() const { return int(segments.size()); };
+  virtual Size  read(FPos pos, Byte* buffer, Size count);
+  virtual FPos  size();
+ protected:
+  static bool  startsAfter(FPos pos, const Segment& seg)
+    { return pos < seg.start; };
+}; // end SplitSource
+
+class ProcessSource : public DataSource
+{
+ protected:
+  struct Region
+  {
+    FPos  start;
+    FPos  end;
+  }; // end Region
+
+  typedef vector<Region>  RegionVec;
+
+  Process    process;
+  RegionVec  regions;
+  BadRanges  bad;
+ public:
+  ProcessSource(Process aProcess);
+  virtual ~ProcessSource();
+  virtual bool  findBad(FPos pos, FPos& start, FPos& end)
+    { return bad.find(pos, start, end); };
+  virtual bool  findHole(FPos pos, FPos& end);
+  virtual bool  isVolatile() const { return true; };
+  virtual Size  read(FPos pos, Byte* buffer, Size count);
+  virtual FPos  size();
+ protected:
+  RegionVec::const_iterator  find(FPos pos) const;
+  static bool  endsAfter(FPos pos, const Region& r) { return pos < r.end; };
+}; // end ProcessSource
+
+class PatternSource : public DataSource
+{
+ protected:
+  String  pattern;
+  FPos    length;
+ public:
+  PatternSource(const String& aPattern, FPos aLength)
+    : pattern(aPattern), length(aLength) {};
+  virtual Size  read(FPos pos, Byte* buffer, Size count);
+  virtual FPos  size() { return length; };
+}; // end PatternSource
+
+class BlockCache
+{
+ protected:
+  struct Block
+  {
+    FPos   pos;
+    Size   length;
+    Byte*  data;
+  }; // end Block
+
+  typedef list<Block>                BlockList;
+  typedef BlockList::iterator        BlockItr;
+  typedef map<FPos, BlockItr>        BlockMap;
+  typedef BlockMap::iterator         BMItr;
+
+  BlockList    blocks;          // Most recently used first
+  BlockMap     index;
+  DataSource*  source;
+  size_t       maxBlocks;       // The most blocks we'll hold (--cache-size)
+  mutex        lock;            // Held while using any of the above
+ public:
+  BlockCache();
+  ~BlockCache();
+  FPos  capacity() const { return FPos(maxBlocks) * cacheBlockSize; };
+  bool  contains(FPos pos);
+  void  insert(FPos pos, Byte* data, Size length);
+  bool  prefetch(FPos pos);
+  void  reset(DataSource* aSource);
+  Size  read(FPos pos, Byte* buffer, Size count);
+ protected:
+  const Block*  getBlock(FPos pos);
+}; // end BlockCache
+
+class StreamBuffer
+{
+ protected:
+  deque<Byte*>  blocks;         // The in-memory window, oldest first
+  File          file;
+  File          spill;          // Holds everything before start
+  FPos          start;          // The file position of blocks.front()
+  FPos          end;            // The number of bytes read so far
+  size_t        maxBlocks;
+  bool          atEOF;
+  mutex         lock;           // Held while using any of the above
+ public:
+  StreamBuffer(File aFile);
+  ~StreamBuffer();
+  FPos  capacity() const { return FPos(maxBlocks) * cacheBlockSize; };
+  FPos  earliest();
+  bool  prefetch(FPos pos);
+  Size  read(FPos pos, Byte* buffer, Size count);
+  FPos  size();
+ protected:
+  void  fill(FPos upTo);
+}; // end StreamBuffer
+
+class Backup
+{
+ protected:
+  File    from;
+  File    to;
+  String  name;
+  bool    ok;
+  bool    done;
+  bool    stopping;
+  mutex   lock;                 // Held while using ok, done or stopping
+  thread  worker;
+ public:
+  Backup();
+  ~Backup();
+  bool  finish();
+  bool  start(const char* fileName);
+ protected:
+  void  run();
+}; // end Backup
+
+class Readahead
+{
+ protected:
+  FileDisplay*        file;
+  File                direct;   // Uncached handle, or InvalidFile
+  FPos                cursor;   // The position being scanned
+  FPos                limit;    // How far ahead of cursor to read
+  FPos                released; // Cache dropped up to here
+  bool                stopping;
+  mutex               lock;     // Held while using cursor or stopping
+  condition_variable  wake;
+  thread              worker;
+ public:
+  Readahead(FileDisplay* aFile, FPos aCursor);
+  ~Readahead();
+  void  advance(FPos pos);
+  bool  isDirect() const { return direct != InvalidFile; };
+ protected:
+  bool  fetch(FPos pos);
+  void  release();
+  void  run();
+#ifdef HAVE_LIBURING
+  void  runQueued(ReadQueue& queue);
+#endif
+}; // end Readahead
+
 class FileDisplay
 {
   friend class Difference;
+  friend class DiffIndex;
+  friend class Readahead;
 
  protected:
+  typedef vector< pair<int, int> >  RangeVec;
+
+  Backup*            backup;
+  RangeVec           bufBad;
   int                bufContents;
+  unsigned           bufLoads;
+  BlockCache         cache;
   FileBuffer*        data;
   const Difference*  diffs;
+  EditMap            edits;
+  FPos               extentStart;
+  FPos               extentEnd;
+  bool               extentHole;
   File               file;
   char               fileName[maxPath];
+  FPos               fileSize;
+  HashTree*          hashes;
+  const Byte*        mapping;
+  FPos               mapSize;
   FPos               offset;
+  String             pattern;
+  Readahead*         readahead;
+  DataSource*        source;
+  StreamBuffer*      stream;
   ConWindow          win;
   bool               writable;
   int                yPos;
@@ -167,34 +556,183 @@ class FileDisplay
   void         resize();
   void         shutDown();
   void         display();
+  bool         copyFrom(FileDisplay& other, FPos pos, FPos length);
+  bool         copyTo(File dest, FPos destPos, FPos pos, FPos length);
   bool         edit(const FileDisplay* other);
+  bool         findDifference(FileDisplay& other, FPos& pos);
+  bool         findPrevDifference(FileDisplay& other, FPos& pos);
+  bool         fill(FPos pos, FPos length, const Byte* pattern,
+                    int patternLen);
   const Byte*  getBuffer() const { return data->buffer; };
-  void         move(int step)    { moveTo(offset + step); };
+  FPos         getOffset() const { return offset; };
+  bool         hasEdits(FPos pos, FPos length) const;
+  bool         isModified() const { return !edits.empty(); };
+  void         move(FPos step)   { moveTo(offset + step); };
   void         moveTo(FPos newOffset);
   bool         moveTo(const Byte* searchFor, int searchLen);
   void         moveToEnd(FileDisplay* other);
-  bool         setFile(const char* aFileName);
+  FPos         getSize();
+  bool         isPattern() const { return !pattern.empty(); };
+  bool         isStream() const  { return stream != NULL; };
+  FPos         lastOffset();
+  FPos         matchPattern(FPos pos, const String& aPattern, FPos phase);
+  bool         save();
+  short        setEdit(FPos pos, short value);
+  bool         setFile(const char* aFileName, File aFile=InvalidFile);
+  void         setPattern(const String& aPattern, FPos length);
+  void         startReadahead();
+  void         stopReadahead();
  protected:
-  void  setByte(short x, short y, Byte b);
+  FPos  badEnd(FPos pos, FPos length);
+  FPos  badStart(FPos pos);
+  FPos  holeEnd(FPos pos);
+  bool  isPlainFile() const { return source && source->isPlainFile(); };
+  bool  makeWritable();
+  void  mapFile();
+  bool  prefetch(FPos pos);
+  Size  readData(FPos pos, Byte* buffer, Size count);
+  Size  readDirect(FPos pos, Byte* buffer, Size count);
+  Size  readUnedited(FPos pos, Byte* buffer, Size count);
+  bool  readyToWrite();
+  void  reread();
+  void  setByte(short x, short y, Byte b, ChangeVec& changes);
 }; // end FileDisplay
 
+class BitSet
+{
+ protected:
+  typedef unsigned long long  Word;
+  enum { wordBits = 64 };
+
+  vector<Word>  words;
+  int           bits;
+ public:
+  BitSet() : bits(0) {};
+  void  clear() { fill(words.begin(), words.end(), 0); };
+  int   count(int start, int end) const;
+  int   findClear(int pos) const { return find(pos, ~Word(0)); };
+  int   findSet(int pos) const   { return find(pos, 0); };
+  void  put(int pos, unsigned mask, int n);
+  void  resize(int size);
+  void  set(int start, int end, bool value);
+  void  shift(int n);
+  int   size() const { return bits; };
+  bool  test(int pos) const
+    { return (words[pos / wordBits] >> (pos % wordBits)) & 1; };
+ protected:
+  int   find(int pos, Word flip) const;
+  static Word  rangeMask(int word, int start, int end);
+}; // end BitSet
+
+struct BlockHash
+{
+  enum { words = 4 };
+
+  unsigned long long  word[words];
+
+  bool operator==(const BlockHash& b) const
+    { return !memcmp(word, b.word, sizeof(word)); };
+}; // end BlockHash
+
+class HashTree
+{
+ protected:
+  typedef vector<BlockHash>  HashVec;
+
+  String           cacheName;
+  FPos             fileSize;
+  FPos             modTime;
+  FPos             changeTime;
+  vector<HashVec>  levels;
+  BitSet           known;
+  int              missing;
+  bool             dirty;
+  mutex            lock;        // Held while using any of the above
+ public:
+  HashTree(const String& aCacheName, File file);
+  ~HashTree();
+  FPos  blockLength(FPos block) const;
+  void  discard();
+  FPos  firstDifference(HashTree& other, FPos block);
+  bool  getBlock(FPos block, BlockHash& hash);
+  void  save();
+  void  setBlock(FPos block, const BlockHash& hash);
+ protected:
+  void  build();
+  FPos  findDifferent(const HashTree& other, int level, FPos node,
+                      FPos from) const;
+  bool  load();
+}; // end HashTree
+
 class Difference
 {
   friend void FileDisplay::display();
 
  protected:
-  FileBuffer*         data;
   const FileDisplay*  file1;
   const FileDisplay*  file2;
+  unsigned            loads1, loads2;
   int                 numDiffs;
+  FPos                offset1, offset2;
+  BitSet              table;
  public:
   Difference(const FileDisplay* aFile1, const FileDisplay* aFile2);
-  ~Difference();
   int  compute();
   int  getNumDiffs() const { return numDiffs; };
   void resize();
 }; // end Difference
 
+class DiffIndex
+{
+ protected:
+  typedef pair<FPos, FPos>     Range; // Start & end of a difference
+  typedef vector<Range>        RangeVec;
+
+  struct Chunk
+  {
+    FPos      end;              // Where the block ends
+    RangeVec  found;            // The differences in it
+  }; // end Chunk
+
+  typedef map<FPos, Chunk>     ChunkMap;
+
+  FileDisplay*        file1;
+  FileDisplay*        file2;
+  FPos                phase;
+  FPos                start;
+  FPos                scanned;
+  FPos                claimed;
+  FPos                limit;
+  FPos                shared;
+  FPos                end;
+  RangeVec            ranges;
+  ChunkMap            finished;
+  int                 active;
+  bool                done;
+  bool                hashing;
+  bool                running;
+  bool                stopping;
+  mutex               lock;     // Held while using any of the above
+  condition_variable  wake;
+  vector<thread>      workers;
+ public:
+  DiffIndex(FileDisplay* aFile1, FileDisplay* aFile2, FPos aStart);
+  ~DiffIndex();
+  bool  covers(FPos pos, FPos aPhase);
+  int   findNext(FPos pos, FPos& diff);
+  int   findPrevious(FPos pos, FPos& diff);
+  static bool  canIndex(const FileDisplay& f1, const FileDisplay& f2);
+ protected:
+  void  addRange(FPos rangeStart, FPos rangeEnd);
+  void  merge();
+  void  run();
+  static bool  endsAfter(FPos pos, const Range& r) { return pos < r.second; };
+  static bool  startsBefore(const Range& r, FPos pos) { return r.first < pos; };
+  static bool  hashBlock(FileDisplay* f, FPos pos, Size count, Byte* buffer,
+                         Size& got, bool& read, BlockHash& hash);
+  static bool  inHole(const FileDisplay* f, FPos pos, FPos end);
+}; // end DiffIndex
+
 class InputManager
 {
  private:
@@ -227,21 +765,40 @@ class InputManager
 
 String       lastSearch;
 StrVec       hexSearchHistory, textSearchHistory, positionHistory;
+StrVec       fileNameHistory;
 ConWindow    promptWin,inWin;
 FileDisplay  file1, file2;
 Difference   diffs(&file1, &file2);
+DiffIndex*   diffIndex = NULL; // The differences past where we last looked
 const char*  displayTable = asciiDisplayTable;
 const char*  program_name; // Name under which this program was invoked
 LockState    lockState = lockNeither;
 bool         singleFile = false;
-
+bool         spillStreams = false; // Keep all of a pipe in a temp file?
+bool         decompress = true;    // Display compressed files uncompressed?
+bool         joinSplits = true;    // Display split images as one file?
+bool         makeBackups = false;  // Back up files before changing them?
+String       againstPattern;       // Compare FILE1 with this, not FILE2
+bool         tolerateErrors = false; // Read around unreadable sectors?
+String       hashCacheDir;         // Where to keep HashTrees (if anywhere)
+
+vector<ChangeVec>  undoList;  // Each edit session, most recent last
+vector<ChangeVec>  redoList;  // Edit sessions that were undone
+
+int  cacheSize = 16;      // Size of each file's BlockCache (in MB)
+int  scanThreads = 0;     // Threads comparing for DiffIndex (0 = 1 per CPU)
+IOPolicy  ioPolicy = ioNormal; // How scans should treat the OS cache
 int  numLines  = 9;       // Number of lines of each file to display
 int  bufSize   = numLines * lineWidth;
 int  linesBetween = 1;    // Number of lines of padding between files
 
+int    offsetDigits = minOffsetDigits; // Hex digits in the offset column
+short  leftMar  = 11;     // Starting column of hex display
+short  leftMar2 = 61;     // Starting column of ASCII display
+
 // The number of bytes to move for each possible step size:
 //   See cmmMoveByte, cmmMoveLine, cmmMovePage
-int  steps[4] = {1, lineWidth, bufSize-lineWidth, 0};
+FPos  steps[4] = {1, lineWidth, bufSize-lineWidth, 0};
 
 
 //====================================================================
@@ -266,190 +823,3818 @@ int safeUC(int c)
   return (c >= 0 && c <= UCHAR_MAX) ? toupper(c) : c;
 } // end safeUC
 
-//====================================================================
-// Class Difference:
-//
-// Member Variables:
-//   file1, file2:
-//     The FileDisplay objects being compared
-//   numDiffs:
-//     The number of differences between the two FileDisplay buffers
-//   line/table:
-//     An array of bools for each byte in the FileDisplay buffers
-//     True marks differences
-//
 //--------------------------------------------------------------------
-// Constructor:
+// Count the bits that are set:
+
+inline int countBits(unsigned bits)
+{
+#ifdef __GNUC__
+  return __builtin_popcount(bits);
+#else
+  int  count = 0;
+
+  for (; bits; bits &= bits - 1)
+    ++count;
+
+  return count;
+#endif
+} // end countBits
+
+//--------------------------------------------------------------------
+// Find the lowest bit that is set:
 //
-// Input:
-//   aFile1, aFile2:
-//     Pointers to the FileDisplay objects to compare
+// bits must not be 0.
 
-Difference::Difference(const FileDisplay* aFile1, const FileDisplay* aFile2)
-: data(NULL),
-  file1(aFile1),
-  file2(aFile2)
+inline int lowestBit(unsigned bits)
 {
-} // end Difference::Difference
+#ifdef __GNUC__
+  return __builtin_ctz(bits);
+#elif defined(_MSC_VER)
+  unsigned long  index;
+  _BitScanForward(&index, bits);
+  return int(index);
+#else
+  int  index = 0;
+
+  while (!(bits & 1)) {
+    bits >>= 1;
+    ++index;
+  }
+
+  return index;
+#endif
+} // end lowestBit
+
+inline int lowestBit(unsigned long long bits)
+{
+  const unsigned  low = unsigned(bits);
+
+  return (low ? lowestBit(low) : 32 + lowestBit(unsigned(bits >> 32)));
+} // end lowestBit
+
+inline int countBits(unsigned long long bits)
+{
+  return countBits(unsigned(bits)) + countBits(unsigned(bits >> 32));
+} // end countBits
 
 //--------------------------------------------------------------------
-Difference::~Difference()
+// Find the highest bit that is set:
+//
+// bits must not be 0.
+
+inline int highestBit(unsigned bits)
 {
-  delete [] reinterpret_cast<Byte*>(data);
-} // end Difference::~Difference
+#ifdef __GNUC__
+  return 31 - __builtin_clz(bits);
+#elif defined(_MSC_VER)
+  unsigned long  index;
+  _BitScanReverse(&index, bits);
+  return int(index);
+#else
+  int  index = 0;
+
+  while (bits >>= 1)
+    ++index;
+
+  return index;
+#endif
+} // end highestBit
 
 //--------------------------------------------------------------------
-// Compute differences:
+// Compare one vector's worth of memory:
 //
-// Input Variables:
-//   file1, file2:  The files to compare
+// With AVX2 this compares 32 bytes in a single instruction, and with
+// SSE2, 16.  Otherwise, we compare 8 bytes as one word, and only look
+// at individual bytes if the word is different.
 //
 // Returns:
-//   The number of differences between the buffers
-//   -1 if both buffers are empty
-//
-// Output Variables:
-//   numDiffs:  The number of differences between the buffers
+//   A mask with bit N set if a[N] != b[N]
 
-int Difference::compute()
+#if defined(HAVE_AVX2)
+const int  vectorSize = 32;
+
+inline unsigned diffMask(const Byte* a, const Byte* b)
 {
-  if (singleFile)
-    // We return 1 so that cmNextDiff won't keep searching:
-    return (file1->bufContents ? 1 : -1);
+  const __m256i  x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+  const __m256i  y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
 
-  memset(data->buffer, 0, bufSize); // Clear the difference table
+  return ~unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+} // end diffMask
 
-  int  different = 0;
+#elif defined(HAVE_SSE2)
+const int  vectorSize = 16;
 
-  const Byte*  buf1 = file1->data->buffer;
-  const Byte*  buf2 = file2->data->buffer;
+inline unsigned diffMask(const Byte* a, const Byte* b)
+{
+  const __m128i  x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+  const __m128i  y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
 
-  int  size = min(file1->bufContents, file2->bufContents);
+  return ~unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFF;
+} // end diffMask
 
-  int  i;
-  for (i = 0; i < size; i++)
-    if (*(buf1++) != *(buf2++)) {
-      data->buffer[i] = true;
-      ++different;
-    }
+#else
+const int  vectorSize = 8;
 
-  size = max(file1->bufContents, file2->bufContents);
+inline unsigned diffMask(const Byte* a, const Byte* b)
+{
+  unsigned long long  x, y;
 
-  if (i < size) {
-    // One buffer has more data than the other:
-    different += size - i;
-    for (; i < size; i++)
-      data->buffer[i] = true;   // These bytes are only in 1 buffer
-  } else if (!size)
-    return -1;                  // Both buffers are empty
+  memcpy(&x, a, vectorSize);
+  memcpy(&y, b, vectorSize);
 
-  numDiffs = different;
+  if (x == y) return 0;
 
-  return different;
-} // end Difference::compute
+  unsigned  mask = 0;
+
+  for (int i = 0; i < vectorSize; ++i)
+    if (a[i] != b[i]) mask |= 1U << i;
+
+  return mask;
+} // end diffMask
+#endif
 
 //--------------------------------------------------------------------
-void Difference::resize()
+// Find the first difference between two blocks of memory:
+//
+// Returns:
+//   The index of the first byte that differs, or count if none do
+
+Size firstMismatch(const Byte* a, const Byte* b, Size count)
 {
-  if (singleFile) return;
+  Size  i = 0;
 
-  if (data)
-    delete [] reinterpret_cast<Byte*>(data);
+  for (; i + vectorSize <= count; i += vectorSize) {
+    const unsigned  mask = diffMask(a + i, b + i);
 
-  data = reinterpret_cast<FileBuffer*>(new Byte[bufSize]);
-} // end Difference::resize
+    if (mask) return i + lowestBit(mask);
+  } // end for each vector
 
-//====================================================================
-// Class FileDisplay:
-//
-// Member Variables:
-//   bufContents:
-//     The number of bytes in the file buffer
-//   diffs:
-//     A pointer to the Difference object related to this file
-//   file:
-//     The file being displayed
-//   fileName:
-//     The relative pathname of the file being displayed
-//   offset:
-//     The position in the file of the first byte in the buffer
-//   win:
-//     The handle of the window used for display
-//   yPos:
-//     The vertical position of the display window
-//   buffer/line:
-//     The currently displayed portion of the file
-//
-//--------------------------------------------------------------------
-// Constructor:
+  while (i < count && a[i] == b[i])
+    ++i;
 
-FileDisplay::FileDisplay()
-: bufContents(0),
-  data(NULL),
-  diffs(NULL),
-  offset(0),
-  writable(false),
-  yPos(0)
-{
-  fileName[0] = '\0';
-} // end FileDisplay::FileDisplay
+  return i;
+} // end firstMismatch
 
 //--------------------------------------------------------------------
-// Initialize:
+// Find the last difference between two blocks of memory:
 //
-// Creates the display window and opens the file.
-//
-// Input:
-//   y:          The vertical position of the display window
-//   aDiff:      The Difference object related to this buffer
-//   aFileName:  The name of the file to display
+// Returns:
+//   The index just past the last byte that differs, or 0 if none do
 
-void FileDisplay::init(int y, const Difference* aDiff,
-                       const char* aFileName)
+Size lastMismatch(const Byte* a, const Byte* b, Size count)
 {
-  diffs = aDiff;
-  yPos  = y;
+  Size  i = count;
 
-  win.init(0,y, screenWidth, (numLines + 1 + ((y==0) ? linesBetween : 0)),
-           cFileWin);
+  for (; i >= vectorSize; i -= vectorSize) {
+    const unsigned  mask = diffMask(a + i - vectorSize, b + i - vectorSize);
 
-  resize();
+    if (mask) return i - vectorSize + highestBit(mask) + 1;
+  } // end for each vector
 
-  if (aFileName)
-    setFile(aFileName);
-} // end FileDisplay::init
+  while (i > 0 && a[i-1] == b[i-1])
+    --i;
+
+  return i;
+} // end lastMismatch
 
 //--------------------------------------------------------------------
-// Destructor:
+// Hash a block of memory:
+//
+// This is BLAKE2b (RFC 7693) with a 256 bit result.  We trust
+// matching hashes to mean the blocks are the same without comparing
+// them, so it needs to be a cryptographic hash: a file that's been
+// tampered with mustn't be able to hide behind a collision.
 
-FileDisplay::~FileDisplay()
+inline unsigned long long rotateRight(unsigned long long x, int bits)
 {
-  shutDown();
-  CloseFile(file);
-  delete [] reinterpret_cast<Byte*>(data);
-} // end FileDisplay::~FileDisplay
+  return (x >> bits) | (x << (64 - bits));
+} // end rotateRight
 
-//--------------------------------------------------------------------
-void FileDisplay::resize()
+inline unsigned long long loadWord(const Byte* p)
 {
-  if (data)
-    delete [] reinterpret_cast<Byte*>(data);
+  unsigned long long  word = 0;
 
-  data = reinterpret_cast<FileBuffer*>(new Byte[bufSize]);
+  for (int i = 7; i >= 0; --i)
+    word = (word << 8) | p[i];
 
-  // FIXME resize window
-} // end FileDisplay::resize
+  return word;
+} // end loadWord
 
-//--------------------------------------------------------------------
-// Shut down the file display:
-//
-// Deletes the display window.
+static const unsigned long long  blake2bIV[8] = {
+  0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL,
+  0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+  0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL,
+  0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
 
-void FileDisplay::shutDown()
+inline void blake2bMix(unsigned long long* v, int a, int b, int c, int d,
+                       unsigned long long x, unsigned long long y)
 {
-  win.close();
-} // end FileDisplay::shutDown
-
+  v[a] += v[b] + x;  v[d] = rotateRight(v[d] ^ v[a], 32);
+  v[c] += v[d];      v[b] = rotateRight(v[b] ^ v[c], 24);
+  v[a] += v[b] + y;  v[d] = rotateRight(v[d] ^ v[a], 16);
+  v[c] += v[d];      v[b] = rotateRight(v[b] ^ v[c], 63);
+} // end blake2bMix
+
+static void blake2bCompress(unsigned long long h[8], const Byte* block,
+                            unsigned long long counter, bool last)
+{
+  static const Byte  sigma[10][16] = {
+    {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+    { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+    { 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+    {  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+    {  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+    {  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+    { 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+    { 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+    {  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+    { 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+  };
+
+  unsigned long long  m[16], v[16];
+
+  for (int i = 0; i < 16; ++i)
+    m[i] = loadWord(block + 8 * i);
+
+  for (int i = 0; i < 8; ++i) {
+    v[i]     = h[i];
+    v[i + 8] = blake2bIV[i];
+  }
+
+  v[12] ^= counter;
+  if (last) v[14] = ~v[14];
+
+  for (int round = 0; round < 12; ++round) {
+    const Byte*  s = sigma[round % 10];
+
+    blake2bMix(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]); // Columns
+    blake2bMix(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+    blake2bMix(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+    blake2bMix(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+    blake2bMix(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]); // Diagonals
+    blake2bMix(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    blake2bMix(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+    blake2bMix(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+  } // end for each round
+
+  for (int i = 0; i < 8; ++i)
+    h[i] ^= v[i] ^ v[i + 8];
+} // end blake2bCompress
+
+BlockHash hashData(const Byte* data, Size length)
+{
+  unsigned long long  h[8];
+
+  for (int i = 0; i < 8; ++i)
+    h[i] = blake2bIV[i];
+
+  h[0] ^= 0x01010000 ^ sizeof(BlockHash); // No key
+
+  // Every block but the last is compressed as it is:
+  Size  done = 0;
+
+  for (; length - done > 128; done += 128)
+    blake2bCompress(h, data + done, done + 128, false);
+
+  // The last block (which may be empty) is padded with zeros:
+  Byte  last[128];
+
+  memset(last, 0, sizeof(last));
+  memcpy(last, data + done, length - done);
+  blake2bCompress(h, last, length, true);
+
+  BlockHash  hash;
+
+  for (int i = 0; i < BlockHash::words; ++i)
+    hash.word[i] = h[i];
+
+  return hash;
+} // end hashData
+
+//--------------------------------------------------------------------
+// Mark the differences between two blocks of memory:
+//
+// Input:
+//   a, b:        The blocks to compare
+//   start, end:  The part of the blocks to compare
+//
+// Output:
+//   diff:  Bit N is set if a[N] != b[N], and cleared otherwise
+//          (for N from start up to end)
+//
+// Returns:
+//   The number of bytes that differ
+
+int markDifferences(const Byte* a, const Byte* b, int start, int end,
+                    BitSet& diff)
+{
+  int  different = 0;
+  int  i = start;
+
+  for (; i + vectorSize <= end; i += vectorSize) {
+    const unsigned  mask = diffMask(a + i, b + i);
+
+    if (mask) different += countBits(mask);
+    diff.put(i, mask, vectorSize);
+  } // end for each vector
+
+  for (; i < end; ++i) {
+    const bool  differs = (a[i] != b[i]);
+
+    different += differs;
+    diff.set(i, i + 1, differs);
+  }
+
+  return different;
+} // end markDifferences
+
+//--------------------------------------------------------------------
+// Format a file position for the offset column:
+//
+// Uses offsetDigits hex digits.  The usual 8 digits are split into
+// two groups of 4.  Wider offsets aren't split, and with the widest
+// one, there's no room for the colon.
+//
+// Input:
+//   buf:  Where to store the offset (must have room for 13 chars)
+//   pos:  The position to format
+//
+// Returns:
+//   The number of characters stored (not counting the NUL)
+
+int formatOffset(char* buf, FPos pos)
+{
+  if (offsetDigits == minOffsetDigits)
+    return sprintf(buf, "%04X %04X:", Word(pos>>16), Word(pos&0xFFFF));
+
+  const unsigned long long  mask = (1ULL << (4 * offsetDigits)) - 1;
+
+  return sprintf(buf, ((offsetDigits < maxOffsetDigits) ? "%0*llX:" : "%0*llX"),
+                 offsetDigits, (static_cast<unsigned long long>(pos) & mask));
+} // end formatOffset
+
+//====================================================================
+// Class BlockCache:
+//
+// Keeps recently read parts of a file in memory, so moving back and
+// forth over the same region doesn't go back to the disk.  The file
+// is read in cacheBlockSize blocks aligned to multiples of that size,
+// and the least recently used block is discarded when the cache
+// holds cacheSize megabytes.
+//
+// Member Variables:
+//   blocks:
+//     The cached blocks, most recently used first
+//   index:
+//     Maps a block's file position to its entry in blocks
+//   source:
+//     Where the blocks come from
+//   maxBlocks:
+//     The number of blocks we can hold (at least 2)
+//   lock:
+//     Serializes access from the UI and Readahead threads
+//     (Reads are positional, so it's only guarding the block list.
+//     It's held while reading so a pipe is read in order.)
+//
+//--------------------------------------------------------------------
+BlockCache::BlockCache()
+: source(NULL),
+  maxBlocks(2)
+{
+} // end BlockCache::BlockCache
+
+//--------------------------------------------------------------------
+BlockCache::~BlockCache()
+{
+  reset(NULL);
+} // end BlockCache::~BlockCache
+
+//--------------------------------------------------------------------
+// Discard the cache contents:
+//
+// Input:
+//   aSource:  The source to read from now on
+
+void BlockCache::reset(DataSource* aSource)
+{
+  lock_guard<mutex>  guard(lock);
+
+  for (BlockItr b = blocks.begin(); b != blocks.end(); ++b)
+    FreeBuffer(b->data);
+
+  blocks.clear();
+  index.clear();
+
+  source = aSource;
+  maxBlocks = max(size_t(2), (size_t(cacheSize) * 1024 * 1024 /
+                              cacheBlockSize));
+} // end BlockCache::reset
+
+//--------------------------------------------------------------------
+// Find a block, reading it if necessary:
+//
+// Input:
+//   pos:  The file position of the block (a multiple of cacheBlockSize)
+//
+// Returns:
+//   The block (which becomes the most recently used one)
+//   NULL if the block could not be read
+
+const BlockCache::Block* BlockCache::getBlock(FPos pos)
+{
+  BMItr  found = index.find(pos);
+
+  if (found != index.end()) {
+    blocks.splice(blocks.begin(), blocks, found->second);
+    return &blocks.front();
+  }
+
+  Byte*  data;
+
+  if (blocks.size() >= maxBlocks) {
+    // Recycle the least recently used block:
+    index.erase(blocks.back().pos);
+    data = blocks.back().data;
+    blocks.pop_back();
+  } else
+    data = static_cast<Byte*>(AllocBuffer(cacheBlockSize));
+
+  // Read the whole block, even if the file hands it over piecemeal:
+  Size  length = 0;
+
+  while (length < cacheBlockSize) {
+    Size  bytesRead = source->read(pos + length, data + length,
+                                   cacheBlockSize - length);
+    if (bytesRead <= 0) {
+      if (bytesRead < 0 && !length) {
+        FreeBuffer(data);
+        return NULL;
+      }
+      break;
+    }
+    length += bytesRead;
+  } // end while block not full
+
+  Block  block = { pos, length, data };
+
+  blocks.push_front(block);
+  index[pos] = blocks.begin();
+
+  return &blocks.front();
+} // end BlockCache::getBlock
+
+//--------------------------------------------------------------------
+// Check whether a block is in the cache:
+//
+// Input:
+//   pos:  The file position of the block (a multiple of cacheBlockSize)
+
+bool BlockCache::contains(FPos pos)
+{
+  lock_guard<mutex>  guard(lock);
+
+  return (index.find(pos) != index.end());
+} // end BlockCache::contains
+
+//--------------------------------------------------------------------
+// Add a block that was read elsewhere:
+//
+// Input:
+//   pos:     The file position of the block (a multiple of cacheBlockSize)
+//   data:    The block's contents (allocated with AllocBuffer)
+//            The cache takes ownership of this
+//   length:  The number of bytes in data (less than cacheBlockSize at EOF)
+
+void BlockCache::insert(FPos pos, Byte* data, Size length)
+{
+  lock_guard<mutex>  guard(lock);
+
+  if (index.find(pos) != index.end()) {
+    FreeBuffer(data);           // Somebody beat us to it
+    return;
+  }
+
+  if (blocks.size() >= maxBlocks) {
+    index.erase(blocks.back().pos);
+    FreeBuffer(blocks.back().data);
+    blocks.pop_back();
+  }
+
+  Block  block = { pos, length, data };
+
+  blocks.push_front(block);
+  index[pos] = blocks.begin();
+} // end BlockCache::insert
+
+//--------------------------------------------------------------------
+// Make sure a block is in the cache:
+//
+// Input:
+//   pos:  The file position of the block (a multiple of cacheBlockSize)
+//
+// Returns:
+//   true:   The block contains data
+//   false:  The block is past EOF or could not be read
+
+bool BlockCache::prefetch(FPos pos)
+{
+  lock_guard<mutex>  guard(lock);
+
+  const Block*  block = getBlock(pos);
+
+  return (block && block->length > 0);
+} // end BlockCache::prefetch
+
+//--------------------------------------------------------------------
+// Read from the file:
+//
+// Input:
+//   pos:     The file position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read (less than count at EOF)
+//   -1 if an error occurred before anything was read
+
+Size BlockCache::read(FPos pos, Byte* buffer, Size count)
+{
+  lock_guard<mutex>  guard(lock);
+
+  Size  total = 0;
+
+  while (count > 0) {
+    const FPos    blockPos = pos - pos % cacheBlockSize;
+    const Block*  block = getBlock(blockPos);
+
+    if (!block) return (total ? total : -1);
+
+    const Size  skip = Size(pos - blockPos);
+    if (block->length <= skip) break; // EOF
+
+    const Size  length = min(count, block->length - skip);
+    memcpy(buffer, block->data + skip, length);
+
+    buffer += length;
+    pos    += length;
+    count  -= length;
+    total  += length;
+
+    if (block->length < cacheBlockSize) break; // EOF
+  } // end while more to read
+
+  return total;
+} // end BlockCache::read
+
+//====================================================================
+// Class DataSource:
+//
+// Something that can be displayed like a file.
+//
+//--------------------------------------------------------------------
+// Find out whether a position is in a hole:
+//
+// See FindHole.  By default, nothing has holes.
+
+bool DataSource::findHole(FPos, FPos& end)
+{
+  end = numeric_limits<FPos>::max();
+
+  return false;
+} // end DataSource::findHole
+
+//--------------------------------------------------------------------
+// Find data that couldn't be read:
+//
+// By default, there isn't any.
+//
+// Input:
+//   pos:  Where to start looking
+//
+// Output:
+//   start, end:  The first unreadable range that ends after pos
+//
+// Returns:
+//   false if there's no unreadable data past pos
+
+bool DataSource::findBad(FPos, FPos&, FPos&)
+{
+  return false;
+} // end DataSource::findBad
+
+//====================================================================
+// Class BadRanges:
+//
+// Remembers the ranges of a DataSource that couldn't be read, so they
+// can be displayed as unreadable and ignored when comparing.
+//
+// Member Variables:
+//   bad:
+//     The ranges we couldn't read (never overlapping or touching)
+//   lock:
+//     Protects bad (other threads may be reading the source)
+//
+//--------------------------------------------------------------------
+// Remember an unreadable range:
+//
+// Input:
+//   start, end:  The range we couldn't read
+
+void BadRanges::add(FPos start, FPos end)
+{
+  lock_guard<mutex>  guard(lock);
+
+  BadItr  next = bad.upper_bound(start);
+
+  if (next != bad.begin()) {
+    BadItr  prev = next;
+    if ((--prev)->second >= start) {
+      // Extend the range before this one:
+      start = prev->first;
+      end   = max(end, prev->second);
+      bad.erase(prev);
+    }
+  } // end if there's a range before this one
+
+  while (next != bad.end() && next->first <= end) {
+    end = max(end, next->second);
+    bad.erase(next++);
+  }
+
+  bad[start] = end;
+} // end BadRanges::add
+
+//--------------------------------------------------------------------
+// Find data that couldn't be read:
+//
+// See DataSource::findBad.
+
+bool BadRanges::find(FPos pos, FPos& start, FPos& end)
+{
+  lock_guard<mutex>  guard(lock);
+
+  BadConstItr  r = bad.upper_bound(pos);
+
+  if (r != bad.begin()) {
+    BadConstItr  prev = r;
+    if ((--prev)->second > pos) r = prev;
+  }
+
+  if (r == bad.end()) return false;
+
+  start = r->first;
+  end   = r->second;
+
+  return true;
+} // end BadRanges::find
+
+//====================================================================
+// Class FileSource:
+//
+// Reads an ordinary file (or a device).
+//
+// With --tolerate-errors, a read that fails is tried again in smaller
+// and smaller pieces, down to a single sector.  Sectors that still
+// can't be read are returned as zeros and remembered in bad, so they
+// can be displayed as unreadable and ignored when comparing.
+//
+// Member Variables:
+//   file:
+//     The file to read (the FileSource does not close it)
+//   bad:
+//     The ranges we couldn't read
+//
+//--------------------------------------------------------------------
+// Read from the file:
+//
+// Input:
+//   pos:     The file position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size FileSource::read(FPos pos, Byte* buffer, Size count)
+{
+  const Size  bytesRead = ReadFileAt(file, pos, buffer, count);
+
+  if (bytesRead < 0 && tolerateErrors)
+    return salvage(pos, buffer, count);
+
+  return bytesRead;
+} // end FileSource::read
+
+//--------------------------------------------------------------------
+// Read as much as we can of a range that had a read error:
+//
+// After a failed read, we try again with half the size, until we're
+// down to one sector; after a successful read, we try twice as much
+// again, so we don't crawl through the rest of the range.
+//
+// Input:
+//   pos:     The file position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read (including unreadable ones)
+
+Size FileSource::salvage(FPos pos, Byte* buffer, Size count)
+{
+  Size  done  = 0;
+  Size  chunk = max(Size(sectorSize), count / 2);
+
+  while (done < count) {
+    // End each read on a sector boundary if possible:
+    FPos  stop = (pos + done + chunk) / sectorSize * sectorSize;
+    if (stop <= pos + done) stop = pos + done + chunk;
+
+    const Size  length    = Size(min(stop - pos - done, FPos(count - done)));
+    const Size  bytesRead = ReadFileAt(file, pos + done, buffer + done,
+                                       length);
+    if (bytesRead == 0) break;  // EOF
+
+    if (bytesRead > 0) {
+      done += bytesRead;
+      chunk = min(chunk * 2, count);
+    } else if (length > sectorSize)
+      chunk = max(Size(sectorSize), length / 2);
+    else {
+      // This sector is unreadable:
+      memset(buffer + done, 0, length);
+      bad.add(pos + done, pos + done + length);
+      done += length;
+    }
+  } // end while more to read
+
+  return done;
+} // end FileSource::salvage
+
+//====================================================================
+// Class CompressedSource:
+//
+// Lets us move around in a compressed file as if it were uncompressed.
+// As we decompress, we record checkpoints at least span bytes apart,
+// where decompression can be restarted.  To read a position, we
+// restart from the last checkpoint before it (unless we're already
+// decompressing just before it) and decompress forward from there.
+//
+// The checkpoints are saved in an index file next to the compressed
+// file, so the next time you look at it, you don't have to decompress
+// everything before the part you want to see.  If we can't write the
+// index file, we just don't save it.
+//
+// Subclasses provide the actual decompression.
+//
+// Member Variables:
+//   points:
+//     The checkpoints, in order of position
+//   file:
+//     The compressed file (the CompressedSource does not close it)
+//   indexName:
+//     The name of the index file
+//   format:
+//     A character identifying the compression format in the index file
+//   piece/pieceLength:
+//     The last piece of output returned by produce, which ends at outPos
+//   outPos:
+//     The uncompressed position we've decompressed to
+//   span:
+//     The minimum distance between checkpoints
+//   total:
+//     The uncompressed size, or -1 if we haven't reached the end yet
+//   active:
+//     True if decompression is in progress (outPos is valid)
+//   dirty:
+//     True if points has changed since we loaded or saved the index
+//   lock:
+//     Serializes access from the UI and Readahead threads
+//
+// Index File Format:
+//   All numbers are 8 byte little-endian integers, except as noted.
+//     "VBDX" (4 bytes), version (1 byte), format (1 byte)
+//     The size, modification time and change time of the compressed file
+//     span, total, and the number of checkpoints
+//   Then for each checkpoint:
+//     out, in, bits (1 byte), window length, window
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Loads the index file, if there is one that matches the file.
+//
+// Input:
+//   aFile:      The compressed file
+//   aFileName:  The name of the compressed file
+//   aFormat:    Identifies the compression format
+
+CompressedSource::CompressedSource(File aFile, const char* aFileName,
+                                   char aFormat)
+: file(aFile),
+  indexName(String(aFileName) + indexSuffix),
+  format(aFormat),
+  piece(NULL),
+  pieceLength(0),
+  outPos(0),
+  span(max(FPos(checkpointSpan), FileSize(aFile) / 256)),
+  total(-1),
+  active(false),
+  dirty(false)
+{
+  loadIndex();
+} // end CompressedSource::CompressedSource
+
+//--------------------------------------------------------------------
+// Destructor:
+//
+// Saves any checkpoints we found since the index was loaded.
+
+CompressedSource::~CompressedSource()
+{
+  if (dirty) saveIndex();
+} // end CompressedSource::~CompressedSource
+
+//--------------------------------------------------------------------
+// Record a checkpoint:
+//
+// Called by produce at each place decompression could restart.
+// Ignored unless it's at least span bytes past the last checkpoint.
+//
+// Input:
+//   out:     The uncompressed position
+//   in:      The compressed position
+//   bits:    The number of bits of the byte before in that are unused
+//   window:  The output preceding out that decompression will need
+//   length:  The number of bytes in window
+
+void CompressedSource::addPoint(FPos out, FPos in, int bits,
+                                const Byte* window, Size length)
+{
+  if (out < (points.empty() ? 0 : points.back().out) + span)
+    return;
+
+  Checkpoint  point;
+  point.out  = out;
+  point.in   = in;
+  point.bits = bits;
+  point.window.assign(window, window + length);
+
+  points.push_back(point);
+  dirty = true;
+} // end CompressedSource::addPoint
+
+//--------------------------------------------------------------------
+// Decompress the next piece of output:
+//
+// Called with lock held.  At EOF, the last piece is kept.
+//
+// Returns:
+//   true:   piece and pieceLength describe the output before outPos
+//   false:  We reached the end of the file, or an error occurred
+
+bool CompressedSource::advance()
+{
+  const Byte*  data;
+  const Size   length = produce(data);
+
+  if (length > 0) {
+    piece       = data;
+    pieceLength = length;
+    return true;
+  }
+
+  if (length < 0) {
+    active      = false;        // Start over next time
+    pieceLength = 0;
+  } else if (total < 0) {
+    total = outPos;             // Now we know the size
+    dirty = true;
+    saveIndex();
+  }
+
+  return false;
+} // end CompressedSource::advance
+
+//--------------------------------------------------------------------
+// Get ready to read from a position:
+//
+// Called with lock held.  Restarts decompression from the best
+// checkpoint, unless we're already in a good place to continue.
+//
+// Input:
+//   pos:  The uncompressed position we want
+//
+// Returns:
+//   true:   Decompression can continue to pos
+//   false:  Decompression could not be restarted
+
+bool CompressedSource::seek(FPos pos)
+{
+  const Checkpoint*  best = NULL;
+
+  for (PointVec::const_iterator p = points.begin();
+       p != points.end() && p->out <= pos; ++p)
+    best = &*p;
+
+  if (active && pos >= outPos - pieceLength &&
+      !(best && best->out > outPos))
+    return true;                // Just keep going
+
+  outPos      = (best ? best->out : 0);
+  pieceLength = 0;
+  active      = restart(best);
+
+  return active;
+} // end CompressedSource::seek
+
+//--------------------------------------------------------------------
+// Read uncompressed data:
+//
+// Input:
+//   pos:     The uncompressed position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read (less than count at EOF)
+//   -1 if an error occurred before anything was read
+
+Size CompressedSource::read(FPos pos, Byte* buffer, Size count)
+{
+  lock_guard<mutex>  guard(lock);
+
+  if (!seek(pos)) return -1;
+
+  Size  got = 0;
+
+  for (;;) {
+    // Copy whatever part of the current piece we want:
+    const FPos  start = outPos - pieceLength;
+
+    if (pos >= start && pos < outPos) {
+      const Size  length = Size(min(FPos(count), outPos - pos));
+      memcpy(buffer, piece + (pos - start), length);
+
+      buffer += length;
+      pos    += length;
+      count  -= length;
+      got    += length;
+    }
+
+    if (!count) break;
+
+    if (!advance()) {
+      if (!active && !got) return -1; // Error
+      break;
+    }
+  } // end forever
+
+  return got;
+} // end CompressedSource::read
+
+//--------------------------------------------------------------------
+// Get the uncompressed size:
+//
+// The first time, this has to decompress the rest of the file
+// (which also gives us checkpoints all the way through it).
+//
+// Returns:
+//   The uncompressed size, or the amount we could decompress
+//   if the file is corrupt
+
+FPos CompressedSource::size()
+{
+  lock_guard<mutex>  guard(lock);
+
+  if (total < 0 && seek(points.empty() ? 0 : points.back().out)) {
+    while (advance())
+      ;
+  }
+
+  return ((total >= 0) ? total : outPos);
+} // end CompressedSource::size
+
+//--------------------------------------------------------------------
+// Write a number to the index file:
+//
+// Input:
+//   f:      The index file
+//   value:  The number to write (in 8 bytes, little-endian)
+
+static void putNumber(FILE* f, FPos value)
+{
+  for (int i = 0; i < 8; ++i)
+    putc(int((value >> (8 * i)) & 0xFF), f);
+} // end putNumber
+
+//--------------------------------------------------------------------
+// Read a number from the index file:
+//
+// Input:
+//   f:  The index file
+//
+// Returns:
+//   The number read (garbage if we hit EOF; check ferror/feof)
+
+static FPos getNumber(FILE* f)
+{
+  FPos  value = 0;
+
+  for (int i = 0; i < 8; ++i)
+    value |= FPos(getc(f) & 0xFF) << (8 * i);
+
+  return value;
+} // end getNumber
+
+//--------------------------------------------------------------------
+// Load the index file:
+//
+// The index is ignored if it doesn't match the file's current size,
+// modification time and change time.  (The change time can't be set
+// back, so even a file rewritten with its old modification time
+// won't match.)
+//
+// Returns:
+//   true:   We loaded the index
+//   false:  There was no usable index
+
+bool CompressedSource::loadIndex()
+{
+  FILE*  f = fopen(indexName.c_str(), "rb");
+  if (!f) return false;
+
+  char  header[6];
+  bool  ok = (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+              memcmp(header, "VBDX\2", 5) == 0 && header[5] == format &&
+              getNumber(f) == FileSize(file) &&
+              getNumber(f) == FileModTime(file) &&
+              getNumber(f) == FileChangeTime(file));
+
+  PointVec  loaded;
+  FPos      loadedSpan  = 0;
+  FPos      loadedTotal = -1;
+
+  if (ok) {
+    loadedSpan  = getNumber(f);
+    loadedTotal = getNumber(f);
+
+    FPos  count = getNumber(f);
+
+    for (; count > 0 && !feof(f); --count) {
+      Checkpoint  point;
+      point.out  = getNumber(f);
+      point.in   = getNumber(f);
+      point.bits = getc(f) & 0x07;
+
+      const FPos  length = getNumber(f);
+      if (length < 0 || length > 65536) {
+        ok = false;
+        break;
+      }
+
+      point.window.resize(size_t(length));
+      if (length &&
+          fread(&point.window[0], 1, size_t(length), f) != size_t(length))
+        break;
+
+      loaded.push_back(point);
+    } // end for each checkpoint
+
+    ok = (ok && !count && !ferror(f) && !feof(f));
+  } // end if header matches
+
+  fclose(f);
+
+  if (!ok) return false;
+
+  points.swap(loaded);
+  span  = loadedSpan;
+  total = loadedTotal;
+
+  return true;
+} // end CompressedSource::loadIndex
+
+//--------------------------------------------------------------------
+// Save the index file:
+//
+// Errors are ignored; we'll just have to decompress again next time.
+
+void CompressedSource::saveIndex()
+{
+  FILE*  f = fopen(indexName.c_str(), "wb");
+  if (!f) return;
+
+  fwrite("VBDX\2", 1, 5, f);
+  putc(format, f);
+  putNumber(f, FileSize(file));
+  putNumber(f, FileModTime(file));
+  putNumber(f, FileChangeTime(file));
+  putNumber(f, span);
+  putNumber(f, total);
+  putNumber(f, FPos(points.size()));
+
+  for (PointVec::const_iterator p = points.begin(); p != points.end(); ++p) {
+    putNumber(f, p->out);
+    putNumber(f, p->in);
+    putc(p->bits, f);
+    putNumber(f, FPos(p->window.size()));
+    if (!p->window.empty())
+      fwrite(&p->window[0], 1, p->window.size(), f);
+  } // end for each checkpoint
+
+  const bool  failed = (ferror(f) != 0);
+
+  if (fclose(f) || failed)
+    remove(indexName.c_str()); // Don't leave a broken index around
+  else
+    dirty = false;
+} // end CompressedSource::saveIndex
+
+#ifdef HAVE_LIBZ
+//====================================================================
+// Class GzipSource:
+//
+// Decompresses a gzip file.  Checkpoints are at deflate block
+// boundaries, and record the last 32K of output (which the following
+// blocks may refer back to) and the bit offset into the compressed
+// data.  This is the technique from zlib's zran.c example.
+//
+// Files with several gzip members (as produced by cat a.gz b.gz) are
+// decompressed as one file.  Anything after the last member that
+// isn't another gzip member is ignored.
+//
+// Member Variables:
+//   strm:
+//     The zlib decompression state
+//   inPos:
+//     The compressed position just after the data in input
+//   have:
+//     The position in window where the next output goes
+//   windowFill:
+//     The number of bytes of valid output in window
+//   skip:
+//     The number of bytes of gzip trailer still to be skipped
+//   finished:
+//     True if we've reached the end of the data
+//   memberDone:
+//     True if we've reached the end of a gzip member
+//   raw:
+//     True if we restarted from a checkpoint, so zlib isn't handling
+//     the gzip header and trailer
+//   window:
+//     The output buffer.  It's circular, so it always has the last
+//     32K of output for the next checkpoint.
+//   input:
+//     The input buffer
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Input:
+//   aFile:      The compressed file
+//   aFileName:  The name of the compressed file
+
+GzipSource::GzipSource(File aFile, const char* aFileName)
+: CompressedSource(aFile, aFileName, 'g')
+{
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit2(&strm, 15 + 16) != Z_OK)
+    throw std::bad_alloc();
+} // end GzipSource::GzipSource
+
+//--------------------------------------------------------------------
+GzipSource::~GzipSource()
+{
+  inflateEnd(&strm);
+} // end GzipSource::~GzipSource
+
+//--------------------------------------------------------------------
+// Read more compressed data:
+//
+// Any unused input is moved to the start of the buffer first.
+//
+// Returns:
+//   true:   We read something
+//   false:  We're at the end of the file (or got an error)
+
+bool GzipSource::fillInput()
+{
+  if (strm.avail_in && strm.next_in != input)
+    memmove(input, strm.next_in, strm.avail_in);
+
+  strm.next_in = input;
+
+  const Size  bytesRead = ReadFileAt(file, inPos, input + strm.avail_in,
+                                     inputSize - strm.avail_in);
+  if (bytesRead <= 0) return false;
+
+  inPos         += bytesRead;
+  strm.avail_in += bytesRead;
+
+  return true;
+} // end GzipSource::fillInput
+
+//--------------------------------------------------------------------
+// Restart decompression:
+//
+// Input:
+//   point:  The checkpoint to restart from (NULL means the beginning)
+//
+// Returns:
+//   true:   Decompression can continue
+//   false:  An error occurred
+
+bool GzipSource::restart(const Checkpoint* point)
+{
+  strm.next_in  = input;
+  strm.avail_in = 0;
+  have = windowFill = 0;
+  skip       = 0;
+  finished   = false;
+  memberDone = false;
+  raw        = (point != NULL);
+
+  if (!point) {
+    inPos = 0;
+    return (inflateReset2(&strm, 15 + 16) == Z_OK);
+  }
+
+  inPos = point->in - (point->bits ? 1 : 0);
+
+  if (inflateReset2(&strm, -15) != Z_OK || !fillInput())
+    return false;
+
+  if (point->bits) {
+    const int  byte = *strm.next_in++;
+    --strm.avail_in;
+    if (inflatePrime(&strm, point->bits, byte >> (8 - point->bits)) != Z_OK)
+      return false;
+  }
+
+  const Size  length = Size(point->window.size());
+
+  if (length) {
+    memcpy(window, &point->window[0], length);
+    if (inflateSetDictionary(&strm, window, length) != Z_OK)
+      return false;
+  }
+
+  have = windowFill = length;
+
+  return true;
+} // end GzipSource::restart
+
+//--------------------------------------------------------------------
+// Decompress the next piece of output:
+//
+// Output:
+//   data:  Points to the output (which ends at outPos)
+//
+// Returns:
+//   The number of bytes of output
+//   0 at the end of the data
+//   -1 if the data is corrupt
+
+Size GzipSource::produce(const Byte*& data)
+{
+  while (!finished) {
+    if (memberDone) {
+      // Skip the trailer (zlib does this for us unless we're raw):
+      while (skip > 0) {
+        if (!strm.avail_in && !fillInput()) break;
+        const int  n = min(skip, int(strm.avail_in));
+        strm.next_in  += n;
+        strm.avail_in -= n;
+        skip          -= n;
+      }
+
+      // See if there's another member:
+      if (strm.avail_in < 2) fillInput();
+
+      if (skip || strm.avail_in < 2 ||
+          strm.next_in[0] != 0x1F || strm.next_in[1] != 0x8B ||
+          inflateReset2(&strm, 15 + 16) != Z_OK) {
+        finished = true;
+        break;
+      }
+
+      memberDone = false;
+      raw        = false;
+    } // end if at end of member
+
+    if (!strm.avail_in && !fillInput()) {
+      finished = true;          // The file is truncated
+      break;
+    }
+
+    if (have == windowSize) have = 0;
+
+    strm.next_out  = window + have;
+    strm.avail_out = windowSize - have;
+
+    const int   status = inflate(&strm, Z_BLOCK);
+    const Size  length = Size((windowSize - have) - strm.avail_out);
+
+    data        = window + have;
+    have       += length;
+    windowFill  = min(Size(windowSize), windowFill + length);
+    outPos     += length;
+
+    if (status == Z_STREAM_END) {
+      memberDone = true;
+      skip       = (raw ? 8 : 0);
+    } else if (status != Z_OK && status != Z_BUF_ERROR)
+      return -1;
+    else if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+             windowFill == windowSize) {
+      // We're at a block boundary; the window is the last 32K of
+      // output, but it may have wrapped around:
+      Byte  saved[windowSize];
+      memcpy(saved, window + have, windowSize - have);
+      memcpy(saved + windowSize - have, window, have);
+
+      addPoint(outPos, inPos - strm.avail_in, strm.data_type & 7,
+               saved, windowSize);
+    } // end else if at block boundary
+
+    if (length) return length;
+  } // end while not finished
+
+  return 0;
+} // end GzipSource::produce
+#endif // HAVE_LIBZ
+
+#ifdef HAVE_LIBZSTD
+//====================================================================
+// Class ZstdSource:
+//
+// Decompresses a zstd file.  Zstandard can only restart at the start
+// of a frame, so checkpoints are at frame boundaries.  If the file
+// was written in the seekable format (zstd's contrib/seekable_format),
+// its seek table gives us the checkpoints without decompressing
+// anything.  A file that's one big frame has no checkpoints at all.
+//
+// Member Variables:
+//   dstream:
+//     The zstd decompression state
+//   in:
+//     Describes the data in input
+//   inPos:
+//     The compressed position just after the data in input
+//   boundary:
+//     True if we're between frames
+//   finished:
+//     True if we've reached the end of the data
+//   input, output:
+//     The input and output buffers
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Input:
+//   aFile:      The compressed file
+//   aFileName:  The name of the compressed file
+
+ZstdSource::ZstdSource(File aFile, const char* aFileName)
+: CompressedSource(aFile, aFileName, 'z'),
+  dstream(ZSTD_createDStream()),
+  input(ZSTD_DStreamInSize()),
+  output(ZSTD_DStreamOutSize())
+{
+  if (!dstream) throw std::bad_alloc();
+
+  if (total < 0) loadSeekTable();
+} // end ZstdSource::ZstdSource
+
+//--------------------------------------------------------------------
+ZstdSource::~ZstdSource()
+{
+  ZSTD_freeDStream(dstream);
+} // end ZstdSource::~ZstdSource
+
+//--------------------------------------------------------------------
+// Read more compressed data:
+//
+// Returns:
+//   true:   We read something
+//   false:  We're at the end of the file (or got an error)
+
+bool ZstdSource::fillInput()
+{
+  const Size  bytesRead = ReadFileAt(file, inPos, &input[0], input.size());
+  if (bytesRead <= 0) return false;
+
+  in.src  = &input[0];
+  in.size = bytesRead;
+  in.pos  = 0;
+  inPos  += bytesRead;
+
+  return true;
+} // end ZstdSource::fillInput
+
+//--------------------------------------------------------------------
+// Use the seek table of a file in the seekable format:
+//
+// The table is a skippable frame at the end of the file, which lists
+// the compressed and decompressed size of every frame.
+
+void ZstdSource::loadSeekTable()
+{
+  const FPos  fileSize = FileSize(file);
+  Byte        footer[9];
+
+  if (fileSize < 17 ||
+      ReadFileAt(file, fileSize - 9, footer, 9) != 9 ||
+      footer[5] != 0xB1 || footer[6] != 0xEA ||
+      footer[7] != 0x92 || footer[8] != 0x8F)
+    return;                     // Not the seekable format
+
+  const FPos  frames = (footer[0] | (footer[1] << 8) | (footer[2] << 16) |
+                        (FPos(footer[3]) << 24));
+  const int   entrySize = ((footer[4] & 0x80) ? 12 : 8);
+  const FPos  tableSize = frames * entrySize;
+
+  if (tableSize + 17 > fileSize) return;
+
+  vector<Byte>  table(size_t(tableSize) + 1);
+
+  if (ReadFileAt(file, fileSize - 9 - tableSize, &table[0],
+                 Size(tableSize)) != tableSize)
+    return;
+
+  FPos  in  = 0;
+  FPos  out = 0;
+
+  for (FPos i = 0; i < frames; ++i) {
+    const Byte*  entry = &table[size_t(i * entrySize)];
+
+    in  += (entry[0] | (entry[1] << 8) | (entry[2] << 16) |
+            (FPos(entry[3]) << 24));
+    out += (entry[4] | (entry[5] << 8) | (entry[6] << 16) |
+            (FPos(entry[7]) << 24));
+
+    addPoint(out, in, 0, NULL, 0);
+  } // end for each frame
+
+  total = out;
+  dirty = false;                // No need to write an index
+} // end ZstdSource::loadSeekTable
+
+//--------------------------------------------------------------------
+// Restart decompression:
+//
+// Input:
+//   point:  The checkpoint to restart from (NULL means the beginning)
+//
+// Returns:
+//   true:   Decompression can continue
+//   false:  An error occurred
+
+bool ZstdSource::restart(const Checkpoint* point)
+{
+  in.src   = &input[0];
+  in.size  = in.pos = 0;
+  inPos    = (point ? point->in : 0);
+  boundary = true;
+  finished = false;
+
+  return !ZSTD_isError(ZSTD_DCtx_reset(dstream, ZSTD_reset_session_only));
+} // end ZstdSource::restart
+
+//--------------------------------------------------------------------
+// Decompress the next piece of output:
+//
+// Output:
+//   data:  Points to the output (which ends at outPos)
+//
+// Returns:
+//   The number of bytes of output
+//   0 at the end of the data
+//   -1 if the data is corrupt
+
+Size ZstdSource::produce(const Byte*& data)
+{
+  while (!finished) {
+    if (in.pos == in.size && !fillInput()) {
+      finished = true;          // End of file (or it's truncated)
+      break;
+    }
+
+    ZSTD_outBuffer  out = { &output[0], output.size(), 0 };
+
+    const size_t  status = ZSTD_decompressStream(dstream, &out, &in);
+
+    if (ZSTD_isError(status)) {
+      // Junk after the last frame is not an error:
+      if (boundary && !out.pos) {
+        finished = true;
+        break;
+      }
+      return -1;
+    }
+
+    outPos  += out.pos;
+    boundary = (status == 0);
+
+    if (boundary)
+      addPoint(outPos, inPos - FPos(in.size - in.pos), 0, NULL, 0);
+
+    if (out.pos) {
+      data = &output[0];
+      return Size(out.pos);
+    }
+  } // end while not finished
+
+  return 0;
+} // end ZstdSource::produce
+#endif // HAVE_LIBZSTD
+
+//--------------------------------------------------------------------
+// Recognize a compressed file:
+//
+// Input:
+//   file:      The file to check
+//   fileName:  The name of the file
+//
+// Returns:
+//   A DataSource that decompresses the file,
+//   or NULL if it's not compressed in a format we support
+
+DataSource* openCompressed(File file, const char* fileName)
+{
+  Byte  magic[4];
+
+  if (ReadFileAt(file, 0, magic, 4) != 4) return NULL;
+
+#ifdef HAVE_LIBZ
+  if (magic[0] == 0x1F && magic[1] == 0x8B)
+    return new GzipSource(file, fileName);
+#endif
+
+#ifdef HAVE_LIBZSTD
+  if (magic[0] == 0x28 && magic[1] == 0xB5 &&
+      magic[2] == 0x2F && magic[3] == 0xFD)
+    return new ZstdSource(file, fileName);
+#endif
+
+  (void) fileName;
+  return NULL;
+} // end openCompressed
+
+//====================================================================
+// Class SplitSource:
+//
+// Reads an image that was split into numbered segments (FILE.001,
+// FILE.002, ...) as if it were one file.  Reads that cross from one
+// segment into the next are split up here, so nothing else needs to
+// know about the segments.
+//
+// The segments' sizes are taken when they're opened, so they
+// shouldn't change while we're displaying them.
+//
+// Member Variables:
+//   segments:
+//     The segments, in order (the first one is the FileDisplay's file,
+//     which the SplitSource does not close)
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Input:
+//   aFile:  The first segment
+
+SplitSource::SplitSource(File aFile)
+{
+  add(aFile);
+} // end SplitSource::SplitSource
+
+//--------------------------------------------------------------------
+// Destructor:
+//
+// Closes all the segments after the first.
+
+SplitSource::~SplitSource()
+{
+  for (SegmentVec::size_type i = 1; i < segments.size(); ++i)
+    CloseFile(segments[i].file);
+} // end SplitSource::~SplitSource
+
+//--------------------------------------------------------------------
+// Add a segment to the end:
+//
+// Input:
+//   aFile:  The next segment (the SplitSource will close it)
+
+void SplitSource::add(File aFile)
+{
+  Segment  seg;
+
+  seg.file  = aFile;
+  seg.start = size();
+  seg.size  = max(FPos(0), FileSize(aFile));
+
+  segments.push_back(seg);
+} // end SplitSource::add
+
+//--------------------------------------------------------------------
+// Read from the joined file:
+//
+// Input:
+//   pos:     The position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size SplitSource::read(FPos pos, Byte* buffer, Size count)
+{
+  // Find the last segment that starts at or before pos:
+  SegmentVec::const_iterator  seg =
+    upper_bound(segments.begin(), segments.end(), pos, startsAfter) - 1;
+
+  Size  total = 0;
+
+  for (; count > 0 && seg != segments.end(); ++seg) {
+    const FPos  skip = pos - seg->start;
+    if (skip >= seg->size) continue; // Empty segment, or past EOF
+
+    const Size  length = Size(min(FPos(count), seg->size - skip));
+    const Size  got    = ReadFileAt(seg->file, skip, buffer, length);
+
+    if (got < 0) return (total ? total : -1);
+
+    buffer += got;
+    pos    += got;
+    count  -= got;
+    total  += got;
+
+    if (got < length) break;    // The segment is shorter than it was
+  } // end for each segment in range
+
+  return total;
+} // end SplitSource::read
+
+//--------------------------------------------------------------------
+// Get the total size of the segments:
+
+FPos SplitSource::size()
+{
+  if (segments.empty()) return 0;
+
+  const Segment&  last = segments.back();
+
+  return last.start + last.size;
+} // end SplitSource::size
+
+//====================================================================
+// Class ProcessSource:
+//
+// Reads the memory of a running process, so it can be displayed like
+// a file.  Positions are addresses in the process.  Addresses that
+// aren't mapped are treated like holes in a sparse file: they read
+// as zeros, and searches and scans skip over them.  Pages that are
+// mapped but can't be read are treated like bad sectors: they read as
+// zeros, but are displayed as unreadable and ignored when comparing.
+//
+// The list of regions is read when the process is opened, so a
+// region the process maps after that won't be seen.
+//
+// Member Variables:
+//   process:
+//     The process to read
+//   regions:
+//     The readable regions of its memory, in order (adjacent regions
+//     are combined)
+//   bad:
+//     The pages we couldn't read
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Input:
+//   aProcess:  The process to read (the ProcessSource will close it)
+
+ProcessSource::ProcessSource(Process aProcess)
+: process(aProcess)
+{
+  MemoryMap  map;
+  Region     r;
+
+  if (!OpenMemoryMap(process, map)) return;
+
+  while (NextMemoryRegion(map, r.start, r.end)) {
+    if (!regions.empty() && regions.back().end == r.start)
+      regions.back().end = r.end;
+    else
+      regions.push_back(r);
+  } // end while more regions
+
+  CloseMemoryMap(map);
+} // end ProcessSource::ProcessSource
+
+//--------------------------------------------------------------------
+ProcessSource::~ProcessSource()
+{
+  CloseProcessMemory(process);
+} // end ProcessSource::~ProcessSource
+
+//--------------------------------------------------------------------
+// Find the first region that ends after pos:
+
+ProcessSource::RegionVec::const_iterator ProcessSource::find(FPos pos) const
+{
+  return upper_bound(regions.begin(), regions.end(), pos, endsAfter);
+} // end ProcessSource::find
+
+//--------------------------------------------------------------------
+// Find out whether an address is in an unmapped gap:
+//
+// See FindHole.
+
+bool ProcessSource::findHole(FPos pos, FPos& end)
+{
+  const RegionVec::const_iterator  r = find(pos);
+
+  if (r == regions.end()) {
+    end = size();               // Nothing more is mapped
+    return (end > pos);
+  }
+
+  if (pos < r->start) {
+    end = r->start;
+    return true;
+  }
+
+  end = r->end;
+
+  return false;
+} // end ProcessSource::findHole
+
+//--------------------------------------------------------------------
+// Read the process's memory:
+//
+// Gaps between regions are filled with zeros.  So is any page of a
+// region that turns out not to be readable, and it's added to bad.
+//
+// Input:
+//   pos:     The address to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read
+
+Size ProcessSource::read(FPos pos, Byte* buffer, Size count)
+{
+  const FPos  limit = size();
+
+  if (pos >= limit) return 0;
+
+  count = Size(min(FPos(count), limit - pos));
+
+  RegionVec::const_iterator  r = find(pos);
+
+  for (Size done = 0; done < count; ) {
+    const FPos  here = pos + done;
+    Size        length;
+
+    if (here < r->start) {
+      length = Size(min(FPos(count - done), r->start - here));
+      memset(buffer + done, 0, length);
+    } else {
+      length = Size(min(FPos(count - done), r->end - here));
+
+      const Size  got = ReadProcessAt(process, here, buffer + done, length);
+
+      if (got > 0)
+        length = got;
+      else {
+        // This page is unreadable:
+        const FPos  pageEnd = (here / memPageSize + 1) * memPageSize;
+
+        length = Size(min(FPos(length), pageEnd - here));
+        memset(buffer + done, 0, length);
+        bad.add(here, here + length);
+      }
+
+      if (here + length == r->end) ++r;
+    } // end else in a region
+
+    done += length;
+  } // end for each region or gap
+
+  return count;
+} // end ProcessSource::read
+
+//--------------------------------------------------------------------
+// Get the size of the process's address space:
+//
+// That's the end of its last region.
+
+FPos ProcessSource::size()
+{
+  return (regions.empty() ? 0 : regions.back().end);
+} // end ProcessSource::size
+
+//--------------------------------------------------------------------
+// Recognize the name of a process:
+//
+// A process is given as pid:NUMBER.
+//
+// Output:
+//   pid:  The process ID
+//
+// Returns:
+//   true if fileName names a process
+
+bool isProcessName(const char* fileName, long& pid)
+{
+  if (strncmp(fileName, "pid:", 4) || !fileName[4] ||
+      strspn(fileName + 4, "0123456789") != strlen(fileName + 4))
+    return false;
+
+  pid = atol(fileName + 4);
+
+  return true;
+} // end isProcessName
+
+//====================================================================
+// Class PatternSource:
+//
+// A file that's just a pattern of bytes repeated over and over, so a
+// file can be compared against it without a real file to compare to.
+//
+// Member Variables:
+//   pattern:
+//     The bytes to repeat
+//   length:
+//     The size of the imaginary file
+//
+//--------------------------------------------------------------------
+// Read the pattern:
+//
+// Input:
+//   pos:     The position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read
+
+Size PatternSource::read(FPos pos, Byte* buffer, Size count)
+{
+  if (pos >= length) return 0;
+
+  count = Size(min(FPos(count), length - pos));
+
+  const Size  patternLen = Size(pattern.size());
+  Size        i = Size(pos % patternLen);
+
+  for (Size n = 0; n < count; ++n) {
+    buffer[n] = Byte(pattern[i]);
+    if (++i == patternLen) i = 0;
+  }
+
+  return count;
+} // end PatternSource::read
+
+//--------------------------------------------------------------------
+// Recognize the first segment of a split image:
+//
+// A file whose extension is all digits, numbered 0 or 1 (as in
+// FILE.000 or FILE.001), is joined with the segments that follow it,
+// for as long as the next number exists.
+//
+// Input:
+//   file:      The file to check
+//   fileName:  The name of the file
+//
+// Returns:
+//   A DataSource that reads all the segments,
+//   or NULL if there's no second segment
+
+DataSource* openSplit(File file, const char* fileName)
+{
+  const char*  ext = strrchr(fileName, '.');
+  if (!ext) return NULL;
+
+  const int  digits = int(strlen(++ext));
+
+  if (digits < 2 || digits > 9 ||
+      strspn(ext, "0123456789") != size_t(digits) ||
+      atoi(ext) > 1)
+    return NULL;
+
+  const String  base(fileName, ext - fileName);
+  SplitSource*  split = new SplitSource(file);
+  char          number[16];
+
+  for (int n = atoi(ext) + 1;; ++n) {
+    snprintf(number, sizeof(number), "%0*d", digits, n);
+    if (int(strlen(number)) > digits) break; // Ran out of numbers
+
+    const File  next = OpenFile((base + number).c_str());
+    if (next == InvalidFile) break;
+
+    split->add(next);
+  } // end for each following segment
+
+  if (split->count() < 2) {
+    delete split;
+    return NULL;
+  }
+
+  return split;
+} // end openSplit
+
+//====================================================================
+// Class StreamBuffer:
+//
+// Lets us move around in a pipe, which can only be read once from
+// start to finish.  We read it only as far as the display needs, and
+// keep the most recent cacheSize megabytes in memory.  If spillStreams
+// is set, blocks that fall out of memory are written to a temporary
+// file, so the whole stream stays available.  Otherwise you can't go
+// back further than what's in memory.
+//
+// Member Variables:
+//   blocks:
+//     The in-memory window, in cacheBlockSize blocks, oldest first
+//   file:
+//     The stream being read
+//   spill:
+//     A temporary file containing everything before start,
+//     or InvalidFile if we're not spilling (or writing it failed)
+//   start:
+//     The stream position of the first byte in blocks
+//     (always a multiple of cacheBlockSize)
+//   end:
+//     The number of bytes we've read from the stream
+//   maxBlocks:
+//     The number of blocks we keep in memory (at least 2)
+//   atEOF:
+//     True if we've read the whole stream (or got an error)
+//   lock:
+//     Serializes access from the UI and Readahead threads
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Input:
+//   aFile:  The stream to read (the StreamBuffer does not close it)
+
+StreamBuffer::StreamBuffer(File aFile)
+: file(aFile),
+  spill(spillStreams ? OpenTempFile() : InvalidFile),
+  start(0),
+  end(0),
+  maxBlocks(max(size_t(2), (size_t(cacheSize) * 1024 * 1024 /
+                            cacheBlockSize))),
+  atEOF(false)
+{
+} // end StreamBuffer::StreamBuffer
+
+//--------------------------------------------------------------------
+StreamBuffer::~StreamBuffer()
+{
+  for (size_t i = 0; i < blocks.size(); ++i)
+    delete [] blocks[i];
+
+  if (spill != InvalidFile) CloseFile(spill);
+} // end StreamBuffer::~StreamBuffer
+
+//--------------------------------------------------------------------
+// Get the first position we can still read:
+
+FPos StreamBuffer::earliest()
+{
+  lock_guard<mutex>  guard(lock);
+
+  return ((spill != InvalidFile) ? 0 : start);
+} // end StreamBuffer::earliest
+
+//--------------------------------------------------------------------
+// Read from the stream until we have the data before a position:
+//
+// Called with lock held.  Discards (or spills) the oldest blocks as
+// necessary to stay within maxBlocks.
+//
+// Input:
+//   upTo:  Read until end reaches this position (or EOF)
+
+void StreamBuffer::fill(FPos upTo)
+{
+  while (end < upTo && !atEOF) {
+    const Size  used = Size(end % cacheBlockSize);
+
+    if (!used) {
+      // Start a new block:
+      Byte*  data;
+
+      if (blocks.size() >= maxBlocks) {
+        data = blocks.front();
+        blocks.pop_front();
+
+        if (spill != InvalidFile &&
+            !WriteFileAt(spill, start, data, cacheBlockSize)) {
+          CloseFile(spill);     // Out of space; stop spilling
+          spill = InvalidFile;
+        }
+        start += cacheBlockSize;
+      } else
+        data = new Byte[cacheBlockSize];
+
+      blocks.push_back(data);
+    } // end if starting a new block
+
+    const Size  bytesRead = ReadFile(file, blocks.back() + used,
+                                     cacheBlockSize - used);
+    if (bytesRead <= 0)
+      atEOF = true;
+    else
+      end += bytesRead;
+  } // end while more to read
+} // end StreamBuffer::fill
+
+//--------------------------------------------------------------------
+// Make sure the stream has been read through a block:
+//
+// Input:
+//   pos:  The stream position of the block (a multiple of cacheBlockSize)
+//
+// Returns:
+//   true:   The block contains data
+//   false:  The block is past EOF
+
+bool StreamBuffer::prefetch(FPos pos)
+{
+  lock_guard<mutex>  guard(lock);
+
+  fill(pos + cacheBlockSize);
+
+  return (end > pos);
+} // end StreamBuffer::prefetch
+
+//--------------------------------------------------------------------
+// Read from the stream:
+//
+// Input:
+//   pos:     The stream position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read (less than count at EOF)
+//   -1 if pos is no longer available
+
+Size StreamBuffer::read(FPos pos, Byte* buffer, Size count)
+{
+  lock_guard<mutex>  guard(lock);
+
+  fill(pos + count);
+
+  Size  total = 0;
+
+  if (pos < start) {
+    // This part has left memory; it's in the spill file if anywhere:
+    const Size  length = Size(min(FPos(count), start - pos));
+
+    if (spill == InvalidFile ||
+        ReadFileAt(spill, pos, buffer, length) != length)
+      return -1;
+
+    buffer += length;
+    pos    += length;
+    count  -= length;
+    total  += length;
+  } // end if reading from spill file
+
+  while (count > 0 && pos < end) {
+    const FPos  index = (pos - start) / cacheBlockSize;
+    const Size  skip  = Size((pos - start) % cacheBlockSize);
+    const Size  length = Size(min(FPos(min(count, cacheBlockSize - skip)),
+                                  end - pos));
+
+    memcpy(buffer, blocks[size_t(index)] + skip, length);
+
+    buffer += length;
+    pos    += length;
+    count  -= length;
+    total  += length;
+  } // end while more in memory
+
+  return total;
+} // end StreamBuffer::read
+
+//--------------------------------------------------------------------
+// Get the size of the stream:
+//
+// This has to read the whole stream.
+
+FPos StreamBuffer::size()
+{
+  lock_guard<mutex>  guard(lock);
+
+  while (!atEOF)
+    fill(end + cacheBlockSize);
+
+  return end;
+} // end StreamBuffer::size
+
+//====================================================================
+// Class Readahead:
+//
+// Reads a file ahead of a sequential scan on a background thread, so
+// the scan finds the data already in memory.  Each FileDisplay being
+// scanned gets its own Readahead, so both files are read concurrently.
+//
+// When built with io_uring support, a file that isn't mapped gets up
+// to readQueueDepth reads in flight at once, instead of one at a time.
+//
+// The ioPolicy setting keeps a big scan from flushing everything else
+// out of the OS cache.  With ioSequential, we drop the pages behind
+// the scan as it goes.  With ioDirect, we read into the BlockCache
+// through an uncached handle (and the FileDisplay reads from the
+// cache instead of its mapping), falling back to ioSequential if the
+// filesystem doesn't allow that.
+//
+// Member Variables:
+//   file:
+//     The FileDisplay being scanned
+//   direct:
+//     The file opened for uncached reads, or InvalidFile
+//   cursor:
+//     The position the scan has reached
+//   limit:
+//     How many bytes past cursor we try to keep in memory
+//   released:
+//     With ioSequential or ioDirect, the position up to which we've
+//     told the OS to drop the file from its cache
+//   stopping:
+//     True when the worker thread should exit
+//   lock:
+//     Protects cursor and stopping
+//   wake:
+//     Signaled when cursor or stopping changes
+//   worker:
+//     The thread that does the reading
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Starts the worker thread.
+//
+// Input:
+//   aFile:    The FileDisplay to read
+//   aCursor:  The position where the scan starts
+
+Readahead::Readahead(FileDisplay* aFile, FPos aCursor)
+: file(aFile),
+  direct(InvalidFile),
+  cursor(aCursor),
+  limit(readaheadSize),
+  released(aCursor - aCursor % cacheBlockSize),
+  stopping(false)
+{
+  if (ioPolicy == ioDirect && file->isPlainFile())
+    direct = OpenFileDirect(file->fileName);
+
+  if (ioPolicy != ioNormal) {
+    AdviseFile(file->file, 0, 0, AdviseSequential);
+    if (file->mapping)
+      AdviseMapping(file->mapping, file->mapSize, AdviseSequential);
+  }
+
+  // Don't read so far ahead that we push out what's being scanned:
+  if (file->stream)
+    limit = min(limit, file->stream->capacity() / 2);
+  else if (!file->mapping || isDirect())
+    limit = min(limit, file->cache.capacity() / 2);
+
+  worker = thread(&Readahead::run, this);
+} // end Readahead::Readahead
+
+//--------------------------------------------------------------------
+// Destructor:
+//
+// Waits for the worker thread to finish its current block and exit.
+
+Readahead::~Readahead()
+{
+  {
+    lock_guard<mutex>  guard(lock);
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+
+  if (isDirect()) CloseFile(direct);
+
+  if (ioPolicy != ioNormal) {
+    AdviseFile(file->file, 0, 0, AdviseNormal);
+    if (file->mapping)
+      AdviseMapping(file->mapping, file->mapSize, AdviseNormal);
+  }
+} // end Readahead::~Readahead
+
+//--------------------------------------------------------------------
+// Tell the worker thread where the scan is:
+//
+// Input:
+//   pos:  The position the scan has reached
+
+void Readahead::advance(FPos pos)
+{
+  {
+    lock_guard<mutex>  guard(lock);
+    cursor = pos;
+  }
+  wake.notify_one();
+} // end Readahead::advance
+
+//--------------------------------------------------------------------
+// Bring a block into memory:
+//
+// Input:
+//   pos:  The file position of the block (a multiple of cacheBlockSize)
+//
+// Returns:
+//   true:   The block contains data
+//   false:  The block is past EOF or could not be read
+
+bool Readahead::fetch(FPos pos)
+{
+  if (!isDirect())
+    return file->prefetch(pos);
+
+  if (file->cache.contains(pos)) return true;
+
+  Byte*  data = static_cast<Byte*>(AllocBuffer(cacheBlockSize));
+  Size   length = ReadFileAt(direct, pos, data, cacheBlockSize);
+
+  if (length <= 0) {
+    FreeBuffer(data);
+    return false;
+  }
+
+  file->cache.insert(pos, data, length);
+
+  return true;
+} // end Readahead::fetch
+
+//--------------------------------------------------------------------
+// Drop the part of the file we've scanned from the OS cache:
+//
+// Called by the worker thread with lock held.  Does nothing unless
+// ioPolicy asks for it, and works in 1 MB steps to limit the number
+// of system calls.
+
+void Readahead::release()
+{
+  if (ioPolicy == ioNormal) return;
+
+  const FPos  behind = cursor - cursor % cacheBlockSize;
+
+  if (behind - released < 16 * cacheBlockSize) return;
+
+  if (file->mapping && released < file->mapSize)
+    AdviseMapping(file->mapping + released,
+                  min(behind, file->mapSize) - released, AdviseDontNeed);
+
+  if (file->isPlainFile())
+    AdviseFile(file->file, released, behind - released, AdviseDontNeed);
+
+  released = behind;
+} // end Readahead::release
+
+//--------------------------------------------------------------------
+// The worker thread:
+
+void Readahead::run()
+{
+#ifdef HAVE_LIBURING
+  if ((!file->mapping && file->isPlainFile()) || isDirect()) {
+    ReadQueue  queue(readQueueDepth);
+
+    if (queue.ok()) {
+      runQueued(queue);
+      return;
+    }
+  } // end if file is read through the cache
+#endif
+
+  unique_lock<mutex>  guard(lock);
+
+  FPos  next = -1;              // The next block to read
+  bool  atEnd = false;
+
+  while (!stopping) {
+    release();
+
+    if (next < cursor) {
+      next  = cursor - cursor % cacheBlockSize;
+      atEnd = false;
+    }
+
+    if (atEnd || next >= cursor + limit) {
+      wake.wait(guard);
+      continue;
+    }
+
+    const FPos  pos = next;
+    next += cacheBlockSize;
+
+    guard.unlock();
+    const bool  gotData = fetch(pos);
+    guard.lock();
+
+    if (!gotData) atEnd = true;
+  } // end while not stopping
+} // end Readahead::run
+
+#ifdef HAVE_LIBURING
+//--------------------------------------------------------------------
+// The worker thread, using io_uring:
+//
+// Keeps up to readQueueDepth blocks in flight and adds each one to
+// the cache as it arrives.  A failed read just stops the readahead;
+// the scan will then read (and report) it synchronously.
+//
+// Input:
+//   queue:  An initialized ReadQueue
+
+void Readahead::runQueued(ReadQueue& queue)
+{
+  struct Request
+  {
+    FPos   pos;
+    Byte*  data;
+    bool   busy;
+  } requests[readQueueDepth];
+
+  for (int i = 0; i < readQueueDepth; ++i) {
+    requests[i].data = static_cast<Byte*>(AllocBuffer(cacheBlockSize));
+    requests[i].busy = false;
+  }
+
+  const File  source = (isDirect() ? direct : file->file);
+
+  unique_lock<mutex>  guard(lock);
+
+  FPos  next = -1;              // The next block to read
+  bool  atEnd = false;
+  int   inFlight = 0;
+
+  for (;;) {
+    release();
+
+    if (next < cursor) {
+      next  = cursor - cursor % cacheBlockSize;
+      atEnd = false;
+    }
+
+    // Queue as many reads as we can:
+    for (int i = 0; (i < readQueueDepth && !stopping && !atEnd &&
+                     next < cursor + limit); ++i) {
+      Request&  r = requests[i];
+      if (r.busy) continue;
+
+      while (next < cursor + limit && file->cache.contains(next))
+        next += cacheBlockSize;
+      if (next >= cursor + limit) break;
+
+      r.pos = next;
+      if (!queue.submit(source, r.pos, r.data, cacheBlockSize, &r))
+        break;
+
+      r.busy = true;
+      ++inFlight;
+      next += cacheBlockSize;
+    } // end for each idle request
+
+    if (!inFlight) {
+      if (stopping) break;
+      wake.wait(guard);
+      continue;
+    }
+
+    // Wait for one to finish:
+    guard.unlock();
+    Size      result = -1;
+    Request*  r = static_cast<Request*>(queue.wait(result));
+    guard.lock();
+
+    if (!r) break;              // The queue is broken; give up
+
+    r->busy = false;
+    --inFlight;
+
+    if (result > 0) {
+      file->cache.insert(r->pos, r->data, result);
+      r->data = static_cast<Byte*>(AllocBuffer(cacheBlockSize));
+    }
+
+    if (result < cacheBlockSize) atEnd = true; // EOF or error
+  } // end forever
+
+  // If we gave up, the kernel may still write into busy buffers:
+  for (int i = 0; i < readQueueDepth; ++i)
+    if (!requests[i].busy) FreeBuffer(requests[i].data);
+} // end Readahead::runQueued
+#endif // HAVE_LIBURING
+
+//====================================================================
+// Class Backup:
+//
+// Copies a file before we change it.  Where the filesystem can, the
+// copy is a copy-on-write clone, which is nearly instant however big
+// the file is.  Otherwise, a background thread copies the data while
+// you edit, and finish() waits for it before anything is saved.
+//
+// Member Variables:
+//   from:
+//     The file being backed up (a handle of our own)
+//   to:
+//     The backup file
+//   name:
+//     The name of the backup file
+//   ok:
+//     False if the copy failed
+//   done:
+//     True when the copy is complete
+//   stopping:
+//     True when the worker thread should give up
+//   lock:
+//     Protects ok, done and stopping
+//   worker:
+//     The thread that copies the data (if the file wasn't cloned)
+//
+//--------------------------------------------------------------------
+// Constructor:
+
+Backup::Backup()
+: from(InvalidFile),
+  to(InvalidFile),
+  ok(true),
+  done(false),
+  stopping(false)
+{
+} // end Backup::Backup
+
+//--------------------------------------------------------------------
+// Destructor:
+//
+// If the copy isn't finished, it's abandoned and the partial backup
+// is deleted.  (Nothing was saved, or finish would have completed it.)
+
+Backup::~Backup()
+{
+  {
+    lock_guard<mutex>  guard(lock);
+    stopping = true;
+  }
+
+  finish();
+
+  if (!done && !name.empty())
+    remove(name.c_str());
+} // end Backup::~Backup
+
+//--------------------------------------------------------------------
+// Wait for the copy to complete:
+//
+// Returns:
+//   true:   The backup is complete
+//   false:  The copy failed (or was abandoned)
+
+bool Backup::finish()
+{
+  if (worker.joinable())
+    worker.join();
+
+  if (to != InvalidFile) {
+    CloseFile(from);
+    CloseFile(to);
+    from = to = InvalidFile;
+  }
+
+  return ok && done;
+} // end Backup::finish
+
+//--------------------------------------------------------------------
+// Start backing up a file:
+//
+// If there's already a backup, we ask before replacing it.  The old
+// one is removed rather than overwritten, so if it's a symlink, we
+// don't write through it.
+//
+// Input:
+//   fileName:  The file to back up
+//
+// Returns:
+//   true:   The backup was cloned or is being copied
+//   false:  Unable to create the backup file (or not allowed to
+//           replace the existing one)
+
+bool Backup::start(const char* fileName)
+{
+  name = String(fileName) + backupSuffix;
+
+  from = OpenFile(fileName);
+  if (from == InvalidFile) return false;
+
+  to = OpenNewFile(name.c_str(), true);
+
+  if (to == InvalidFile && FileExisted() &&
+      askYesNo("Replace the existing backup file (Y/N):") &&
+      remove(name.c_str()) == 0)
+    to = OpenNewFile(name.c_str(), true);
+
+  if (to == InvalidFile) {
+    CloseFile(from);
+    from = InvalidFile;
+    name.clear();
+    return false;
+  }
+
+  CopyFileMode(from, to);
+
+  if (CloneFile(from, to))
+    done = true;
+  else
+    worker = thread(&Backup::run, this);
+
+  return true;
+} // end Backup::start
+
+//--------------------------------------------------------------------
+// The worker thread:
+//
+// Copies the file in copyChunk pieces, checking between pieces
+// whether we've been told to stop.
+
+void Backup::run()
+{
+  FPos  pos = 0;
+
+  for (;;) {
+    {
+      lock_guard<mutex>  guard(lock);
+      if (stopping) return;
+    }
+
+    const Size  copied = CopyFileRange(from, pos, to, pos, copyChunk);
+
+    lock_guard<mutex>  guard(lock);
+    if (copied < 0) ok = false;
+    if (copied <= 0) {
+      done = ok;
+      return;
+    }
+
+    pos += copied;
+  } // end forever
+} // end Backup::run
+
+//====================================================================
+// Class BitSet:
+//
+// A fixed number of bits, packed into words.  Bits past the end of
+// the set are always clear.
+//
+// Member Variables:
+//   bits:
+//     The number of bits in the set
+//   words:
+//     The bits, starting with the low bit of the first word
+//
+//--------------------------------------------------------------------
+// Change the size of the set:
+//
+// All the bits are cleared.
+
+void BitSet::resize(int size)
+{
+  bits = size;
+  words.assign((size + wordBits - 1) / wordBits, 0);
+} // end BitSet::resize
+
+//--------------------------------------------------------------------
+// Select part of a range of bits within one word:
+//
+// Input:
+//   word:        The index of the word
+//   start, end:  The range of bits (end is exclusive)
+//
+// Returns:
+//   The bits of word that fall between start and end
+
+BitSet::Word BitSet::rangeMask(int word, int start, int end)
+{
+  const int  first = max(start - word * wordBits, 0);
+  const int  last  = min(end   - word * wordBits, int(wordBits));
+
+  if (first >= last) return 0;
+
+  const Word  upTo = ((last == wordBits) ? ~Word(0)
+                                         : (Word(1) << last) - 1);
+
+  return upTo & (~Word(0) << first);
+} // end BitSet::rangeMask
+
+//--------------------------------------------------------------------
+// Count the bits that are set in a range:
+
+int BitSet::count(int start, int end) const
+{
+  int  total = 0;
+
+  for (int w = start / wordBits; start < end && w <= (end-1) / wordBits; ++w)
+    total += countBits(words[w] & rangeMask(w, start, end));
+
+  return total;
+} // end BitSet::count
+
+//--------------------------------------------------------------------
+// Find the next bit that is set (or clear):
+//
+// Input:
+//   pos:   Where to start looking
+//   flip:  0 to look for a set bit, all ones to look for a clear bit
+//
+// Returns:
+//   The index of the bit, or size() if there isn't one
+
+int BitSet::find(int pos, Word flip) const
+{
+  if (pos >= bits) return bits;
+
+  int   w = pos / wordBits;
+  Word  x = (words[w] ^ flip) & (~Word(0) << (pos % wordBits));
+
+  while (!x) {
+    if (++w == int(words.size())) return bits;
+    x = words[w] ^ flip;
+  }
+
+  return min(bits, w * wordBits + lowestBit(x));
+} // end BitSet::find
+
+//--------------------------------------------------------------------
+// Store up to 32 bits:
+//
+// Input:
+//   pos:   The index of the first bit to store
+//   mask:  The bits to store, starting with the low bit
+//   n:     The number of bits to store (pos + n must be <= size())
+
+void BitSet::put(int pos, unsigned mask, int n)
+{
+  const Word  ones  = (Word(1) << n) - 1;
+  const Word  value = Word(mask) & ones;
+  const int   w     = pos / wordBits;
+  const int   b     = pos % wordBits;
+
+  words[w] = (words[w] & ~(ones << b)) | (value << b);
+
+  if (b + n > wordBits) {
+    const Word  high = (Word(1) << (b + n - wordBits)) - 1;
+    words[w+1] = (words[w+1] & ~high) | (value >> (wordBits - b));
+  }
+} // end BitSet::put
+
+//--------------------------------------------------------------------
+// Set or clear a range of bits:
+//
+// Input:
+//   start, end:  The range of bits (end is exclusive)
+//   value:       true to set them, false to clear them
+
+void BitSet::set(int start, int end, bool value)
+{
+  for (int w = start / wordBits; start < end && w <= (end-1) / wordBits; ++w)
+    if (value)
+      words[w] |= rangeMask(w, start, end);
+    else
+      words[w] &= ~rangeMask(w, start, end);
+} // end BitSet::set
+
+//--------------------------------------------------------------------
+// Move all the bits:
+//
+// Bits that move past either end are lost, and the bits left empty
+// are cleared.
+//
+// Input:
+//   n:  The number of places to move each bit towards the start
+//       (negative to move them towards the end)
+
+void BitSet::shift(int n)
+{
+  const int  numWords = int(words.size());
+
+  if (n >= bits || -n >= bits) {
+    clear();
+    return;
+  }
+
+  const int  wordShift = abs(n) / wordBits;
+  const int  bitShift  = abs(n) % wordBits;
+
+  if (n > 0) {
+    for (int w = 0; w < numWords; ++w) {
+      const int  from = w + wordShift;
+      Word       x    = (from < numWords) ? words[from] >> bitShift : 0;
+      if (bitShift && from + 1 < numWords)
+        x |= words[from + 1] << (wordBits - bitShift);
+      words[w] = x;
+    }
+  } else if (n < 0) {
+    for (int w = numWords - 1; w >= 0; --w) {
+      const int  from = w - wordShift;
+      Word       x    = (from >= 0) ? words[from] << bitShift : 0;
+      if (bitShift && from > 0)
+        x |= words[from - 1] >> (wordBits - bitShift);
+      words[w] = x;
+    }
+
+    // Bits that moved past the end must be clear:
+    if (bits % wordBits)
+      words[numWords - 1] &= (Word(1) << (bits % wordBits)) - 1;
+  } // end else moving towards the end
+} // end BitSet::shift
+
+//====================================================================
+// Class Difference:
+//
+// Member Variables:
+//   file1, file2:
+//     The FileDisplay objects being compared
+//   loads1, loads2:
+//     The bufLoads of file1 and file2 when we last computed
+//   numDiffs:
+//     The number of differences between the two FileDisplay buffers
+//     (-1 if they haven't been compared)
+//   offset1, offset2:
+//     The offsets of file1 and file2 when we last computed
+//   table:
+//     A bit for each byte in the FileDisplay buffers
+//     Set bits mark differences
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Input:
+//   aFile1, aFile2:
+//     Pointers to the FileDisplay objects to compare
+
+Difference::Difference(const FileDisplay* aFile1, const FileDisplay* aFile2)
+: file1(aFile1),
+  file2(aFile2),
+  loads1(0),
+  loads2(0),
+  numDiffs(-1),
+  offset1(0),
+  offset2(0)
+{
+} // end Difference::Difference
+
+//--------------------------------------------------------------------
+// Compute differences:
+//
+// If both files have just scrolled the same distance, and neither
+// buffer has been read again from scratch, we only need to compare
+// the bytes that scrolled into view.
+//
+// Input Variables:
+//   file1, file2:  The files to compare
+//
+// Returns:
+//   The number of differences between the buffers
+//   -1 if both buffers are empty
+//
+// Output Variables:
+//   numDiffs:  The number of differences between the buffers
+
+int Difference::compute()
+{
+  if (singleFile)
+    // We return 1 so that cmNextDiff won't keep searching:
+    return (file1->bufContents ? 1 : -1);
+
+  const FPos  shift = file1->offset - offset1;
+  const bool  scrolled = (numDiffs >= 0 && shift != 0 &&
+                          shift == file2->offset - offset2 &&
+                          shift > -bufSize && shift < bufSize &&
+                          file1->bufLoads == loads1 &&
+                          file2->bufLoads == loads2 &&
+                          file1->bufContents == bufSize &&
+                          file2->bufContents == bufSize);
+
+  offset1 = file1->offset;
+  offset2 = file2->offset;
+  loads1  = file1->bufLoads;
+  loads2  = file2->bufLoads;
+
+  int  different = 0;
+  int  start = 0;               // The part of the buffers to compare
+  int  stop  = bufSize;
+  int  i;
+
+  if (!scrolled)
+    table.clear();
+  else {
+    // Keep the results for the bytes that are still on screen:
+    different = numDiffs;
+    if (shift > 0) {
+      different -= table.count(0, int(shift));
+      start = bufSize - int(shift);
+    } else {
+      different -= table.count(bufSize + int(shift), bufSize);
+      stop = int(-shift);
+    }
+    table.shift(int(shift));
+  } // end else scrolled
+
+  const Byte*  buf1 = file1->data->buffer;
+  const Byte*  buf2 = file2->data->buffer;
+
+  int  size = min(min(file1->bufContents, file2->bufContents), stop);
+
+  i = max(start, size);
+  if (size > start)
+    different += markDifferences(buf1, buf2, start, size, table);
+
+  size = max(file1->bufContents, file2->bufContents);
+
+  if (scrolled)
+    ;                           // Both buffers are full
+  else if (i < size) {
+    // One buffer has more data than the other:
+    different += size - i;
+    table.set(i, size, true);   // These bytes are only in 1 buffer
+  } else if (!size)
+    return (numDiffs = -1);     // Both buffers are empty
+
+  // We don't know whether unreadable bytes are different:
+  const FileDisplay::RangeVec*  bad[2] = { &file1->bufBad, &file2->bufBad };
+
+  for (int f = 0; f < 2; ++f)
+    for (VecSize r = 0; r < bad[f]->size(); ++r) {
+      different -= table.count((*bad[f])[r].first, (*bad[f])[r].second);
+      table.set((*bad[f])[r].first, (*bad[f])[r].second, false);
+    }
+
+  numDiffs = different;
+
+  return different;
+} // end Difference::compute
+
+//--------------------------------------------------------------------
+void Difference::resize()
+{
+  if (singleFile) return;
+
+  table.resize(bufSize);
+  numDiffs = -1;
+} // end Difference::resize
+
+//====================================================================
+// Class HashTree:
+//
+// Remembers a hash of each scanBlockSize block of a file, in a cache
+// file named after the file's device and inode, so the next time
+// it's compared we know which blocks are the same without reading
+// them.  Once every block has been hashed, the hashes are built into
+// a Merkle tree (each node above the blocks is the hash of its two
+// children), so two files of the same size can skip everything
+// they have in common in O(log n) steps.
+//
+// Hashes are only added (by DiffIndex) for whole blocks read without
+// unsaved edits.  The cache is ignored if the file's size,
+// modification time or change time is different from when it was
+// saved.  The change time can't be set back, so a file rewritten in
+// place can't reuse the old hashes, even if its modification time
+// is restored.
+//
+// Member Variables:
+//   cacheName:
+//     The name of the cache file
+//   fileSize:
+//     The size of the file when we opened it
+//   modTime:
+//     The modification time of the file when we opened it
+//   changeTime:
+//     The change time of the file when we opened it
+//   levels:
+//     levels[0] holds the hash of each block.  If every block has
+//     been hashed, each level after that holds the hashes of pairs
+//     of nodes from the level before, up to a single root.
+//   known:
+//     Which blocks in levels[0] have been hashed
+//   missing:
+//     The number of blocks that haven't been hashed yet
+//   dirty:
+//     True if we've hashed blocks since we loaded or saved the cache
+//   lock:
+//     Serializes access from DiffIndex's worker threads
+//
+// Cache File Format:
+//   All numbers are 8 byte little-endian integers, except as noted.
+//     "VBHT" (4 bytes), version (1 byte)
+//     scanBlockSize, and the size, modification time and change time
+//     of the file
+//     The number of blocks
+//   Then for each block:
+//     1 if it's been hashed, otherwise 0 (1 byte)
+//     Its hash (BlockHash::words numbers)
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Loads the cache file, if there is one that matches the file.
+//
+// Input:
+//   aCacheName:  The name of the cache file
+//   file:        The file being hashed
+
+HashTree::HashTree(const String& aCacheName, File file)
+: cacheName(aCacheName),
+  fileSize(FileSize(file)),
+  modTime(FileModTime(file)),
+  changeTime(FileChangeTime(file)),
+  missing(0),
+  dirty(false)
+{
+  if (load()) return;
+
+  const int  blocks = int((fileSize + scanBlockSize - 1) / scanBlockSize);
+
+  levels.assign(1, HashVec(blocks));
+  known.resize(blocks);
+  missing = blocks;
+
+  if (!missing) build();
+} // end HashTree::HashTree
+
+//--------------------------------------------------------------------
+// Destructor:
+//
+// Saves any hashes we added since the cache was loaded.
+
+HashTree::~HashTree()
+{
+  save();
+} // end HashTree::~HashTree
+
+//--------------------------------------------------------------------
+// How much of the file does a block hold?
+
+FPos HashTree::blockLength(FPos block) const
+{
+  return min(FPos(scanBlockSize), fileSize - block * scanBlockSize);
+} // end HashTree::blockLength
+
+//--------------------------------------------------------------------
+// Build the levels of the tree above the blocks:
+//
+// Called with lock held, once every block has been hashed.
+
+void HashTree::build()
+{
+  levels.resize(1);
+
+  while (levels.back().size() > 1) {
+    const HashVec&  below = levels.back();
+    HashVec         above((below.size() + 1) / 2);
+
+    for (VecSize i = 0; i < above.size(); ++i) {
+      const VecSize  children = min(VecSize(2), below.size() - 2 * i);
+
+      above[i] = hashData(reinterpret_cast<const Byte*>(&below[2 * i]),
+                          Size(children * sizeof(BlockHash)));
+    }
+
+    levels.push_back(above);
+  } // end while more than one node at the top
+} // end HashTree::build
+
+//--------------------------------------------------------------------
+// Forget the hashes, because the file was written:
+//
+// The cache file is removed, since the file may still have the same
+// size and modification time.
+
+void HashTree::discard()
+{
+  lock_guard<mutex>  guard(lock);
+
+  remove(cacheName.c_str());
+  dirty = false;
+} // end HashTree::discard
+
+//--------------------------------------------------------------------
+// Find the next block that differs from another file:
+//
+// This only works if both files are the same size and every block
+// of both has been hashed.
+//
+// Input:
+//   other:  The HashTree for the other file
+//   block:  The first block to consider
+//
+// Returns:
+//   The first block at or after block whose hash is different,
+//   the number of blocks if there isn't one,
+//   or -1 if the trees can't tell us
+
+FPos HashTree::firstDifference(HashTree& other, FPos block)
+{
+  {
+    lock_guard<mutex>  guard(lock);
+    if (missing || !fileSize) return -1;
+  }
+  {
+    lock_guard<mutex>  guard(other.lock);
+    if (other.missing || other.fileSize != fileSize) return -1;
+  }
+
+  // Once every block is hashed, the tree doesn't change any more:
+  const FPos  diff = findDifferent(other, int(levels.size()) - 1, 0, block);
+
+  return ((diff < 0) ? FPos(levels[0].size()) : diff);
+} // end HashTree::firstDifference
+
+//--------------------------------------------------------------------
+// Search one node of the tree for a block that differs:
+//
+// Input:
+//   other:  The HashTree for the other file (with the same shape)
+//   level:  The level of the tree the node is in
+//   node:   The index of the node in that level
+//   from:   The first block to consider
+//
+// Returns:
+//   The first block at or after from under this node whose hash is
+//   different, or -1 if there isn't one
+
+FPos HashTree::findDifferent(const HashTree& other, int level, FPos node,
+                             FPos from) const
+{
+  if (((node + 1) << level) <= from ||
+      node >= FPos(levels[level].size()) ||
+      levels[level][node] == other.levels[level][node])
+    return -1;                  // Nothing to find here
+
+  if (!level) return node;
+
+  const FPos  diff = findDifferent(other, level - 1, 2 * node, from);
+
+  return ((diff >= 0) ? diff
+                      : findDifferent(other, level - 1, 2 * node + 1, from));
+} // end HashTree::findDifferent
+
+//--------------------------------------------------------------------
+// Get the hash of a block, if we know it:
+//
+// Returns:
+//   true if the block has been hashed
+
+bool HashTree::getBlock(FPos block, BlockHash& hash)
+{
+  lock_guard<mutex>  guard(lock);
+
+  if (!known.test(int(block))) return false;
+
+  hash = levels[0][block];
+
+  return true;
+} // end HashTree::getBlock
+
+//--------------------------------------------------------------------
+// Record the hash of a block:
+
+void HashTree::setBlock(FPos block, const BlockHash& hash)
+{
+  lock_guard<mutex>  guard(lock);
+
+  if (known.test(int(block))) return;
+
+  levels[0][block] = hash;
+  known.set(int(block), int(block) + 1, true);
+  dirty = true;
+
+  if (!--missing) build();
+} // end HashTree::setBlock
+
+//--------------------------------------------------------------------
+// Load the cache file:
+//
+// Returns:
+//   true:   We loaded the cache
+//   false:  There was no usable cache
+
+bool HashTree::load()
+{
+  FILE*  f = fopen(cacheName.c_str(), "rb");
+  if (!f) return false;
+
+  const FPos  blocks = (fileSize + scanBlockSize - 1) / scanBlockSize;
+
+  char  header[5];
+  bool  ok = (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+              memcmp(header, "VBHT\2", 5) == 0 &&
+              getNumber(f) == scanBlockSize &&
+              getNumber(f) == fileSize &&
+              getNumber(f) == modTime &&
+              getNumber(f) == changeTime &&
+              getNumber(f) == blocks);
+
+  if (ok) {
+    levels.assign(1, HashVec(VecSize(blocks)));
+    known.resize(int(blocks));
+    missing = 0;
+
+    for (int i = 0; i < blocks; ++i) {
+      const bool  hashed = (getc(f) == 1);
+
+      for (int w = 0; w < BlockHash::words; ++w)
+        levels[0][i].word[w] = getNumber(f);
+
+      if (hashed)
+        known.set(i, i + 1, true);
+      else
+        ++missing;
+    } // end for each block
+
+    ok = (!ferror(f) && !feof(f));
+  } // end if header matches
+
+  fclose(f);
+
+  if (!ok) return false;
+
+  if (!missing) build();
+
+  return true;
+} // end HashTree::load
+
+//--------------------------------------------------------------------
+// Save the cache file:
+//
+// Does nothing if there's nothing new to save.  Errors are ignored;
+// we'll just have to read the file again next time.
+
+void HashTree::save()
+{
+  lock_guard<mutex>  guard(lock);
+
+  if (!dirty) return;
+
+  FILE*  f = fopen(cacheName.c_str(), "wb");
+  if (!f) return;
+
+  fwrite("VBHT\2", 1, 5, f);
+  putNumber(f, scanBlockSize);
+  putNumber(f, fileSize);
+  putNumber(f, modTime);
+  putNumber(f, changeTime);
+  putNumber(f, FPos(levels[0].size()));
+
+  for (VecSize i = 0; i < levels[0].size(); ++i) {
+    putc(known.test(int(i)) ? 1 : 0, f);
+    for (int w = 0; w < BlockHash::words; ++w)
+      putNumber(f, FPos(levels[0][i].word[w]));
+  } // end for each block
+
+  const bool  failed = (ferror(f) != 0);
+
+  if (fclose(f) || failed)
+    remove(cacheName.c_str()); // Don't leave a broken cache around
+  else
+    dirty = false;
+} // end HashTree::save
+
+//--------------------------------------------------------------------
+// Open the HashTree for a file:
+//
+// Input:
+//   file:  The file to hash
+//
+// Returns:
+//   The file's HashTree, or NULL if we're not keeping them
+//   (or can't tell which file this is)
+
+HashTree* openHashTree(File file)
+{
+  FPos  device, inode;
+
+  // Unreadable sectors are read as zeros, which we mustn't hash:
+  if (hashCacheDir.empty() || tolerateErrors ||
+      !FileId(file, device, inode))
+    return NULL;
+
+  ostringstream  name;
+  name << hashCacheDir << '/' << hex << device << '-' << inode << hashSuffix;
+
+  return new HashTree(name.str(), file);
+} // end openHashTree
+
+//====================================================================
+// Class DiffIndex:
+//
+// Compares two files on background threads, from a starting point
+// to the end, and records where they differ.  Once the scan has
+// passed a position, finding the next difference after it is just a
+// binary search.
+//
+// Each worker thread claims the next block of scanBlockSize bytes,
+// compares it, and leaves what it found in finished.  (Blocks are
+// aligned to multiples of scanBlockSize, to match the HashTrees.)
+// Blocks are merged into ranges strictly in order, so the index
+// never has a gap, and the first difference after any position is
+// exact as soon as the blocks before it are done.  Workers stay
+// within a few blocks each of the merged position, so we don't race
+// ahead of a caller who's waiting for the next difference.
+//
+// If both files have HashTrees (see --hash-cache), a block whose
+// hashes match is the same, so at most one of the files has to be
+// read (to hash it).  Once both trees are complete, a worker can
+// claim everything up to the next block that differs at once.
+//
+// Only files that can safely be read from another thread (see
+// FileDisplay::readDirect) can be indexed, and the index knows
+// nothing about unsaved edits.  It's discarded (see discardDiffIndex)
+// before a file is reopened for writing or changed, or when the files
+// are lined up differently.
+//
+// Member Variables:
+//   file1, file2:
+//     The files being compared
+//   phase:
+//     The position in file2 that lines up with position 0 in file1
+//   start:
+//     The position in file1 where the scan began
+//   scanned:
+//     The position in file1 up to which blocks have been merged
+//   claimed:
+//     The position in file1 of the next block for a worker to claim
+//   limit:
+//     Don't claim blocks past this (it's moved back after an error,
+//     or if we have too many ranges)
+//   shared:
+//     The position in file1 where the shorter file ends
+//   end:
+//     The position in file1 where the longer file ends
+//   ranges:
+//     The differences found, in order, by file1 position (differences
+//     less than a line apart are recorded as one range)
+//   finished:
+//     Blocks compared but not yet merged, by their position in file1
+//   active:
+//     The number of worker threads that haven't exited
+//   done:
+//     True if the scan reached the end of both files
+//   hashing:
+//     True if both files have HashTrees we can use
+//     (only when they're lined up at the same position)
+//   running:
+//     True while the worker threads are still scanning
+//   stopping:
+//     True when the worker threads should exit
+//   wake:
+//     Signaled when the scan makes progress or finishes
+//   workers:
+//     The threads that do the comparing
+//
+//--------------------------------------------------------------------
+// Constructor:
+//
+// Starts the worker threads.
+//
+// Input:
+//   aFile1, aFile2:  The files to compare, lined up as displayed
+//   aStart:          The position in file1 to start from
+
+DiffIndex::DiffIndex(FileDisplay* aFile1, FileDisplay* aFile2, FPos aStart)
+: file1(aFile1),
+  file2(aFile2),
+  phase(aFile2->offset - aFile1->offset),
+  start(aStart),
+  scanned(aStart),
+  claimed(aStart),
+  active(0),
+  done(false),
+  hashing(false),
+  running(true),
+  stopping(false)
+{
+  const FPos  size1 = file1->getSize();
+  const FPos  size2 = file2->getSize() - phase;
+
+  shared = min(size1, size2);
+  end    = max(size1, size2);
+  limit  = shared;
+
+  hashing = (!phase && file1->hashes && file2->hashes);
+
+  if (hashing)                  // Start with a whole block, to hash it
+    scanned = claimed = start - start % scanBlockSize;
+
+  int  threads = scanThreads;
+  if (threads <= 0)
+    threads = max(1, int(thread::hardware_concurrency()));
+
+  lock_guard<mutex>  guard(lock);
+
+  active = threads;
+  for (int i = 0; i < threads; ++i)
+    workers.push_back(thread(&DiffIndex::run, this));
+} // end DiffIndex::DiffIndex
+
+//--------------------------------------------------------------------
+// Destructor:
+//
+// Waits for the worker threads to finish their current blocks and exit.
+
+DiffIndex::~DiffIndex()
+{
+  {
+    lock_guard<mutex>  guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for (VecSize i = 0; i < workers.size(); ++i)
+    workers[i].join();
+
+  if (hashing) {
+    file1->hashes->save();
+    file2->hashes->save();
+  }
+} // end DiffIndex::~DiffIndex
+
+//--------------------------------------------------------------------
+// Can these files be indexed?
+
+bool DiffIndex::canIndex(const FileDisplay& f1, const FileDisplay& f2)
+{
+  return (f1.isPlainFile() && f2.isPlainFile() &&
+          f1.edits.empty() && f2.edits.empty());
+} // end DiffIndex::canIndex
+
+//--------------------------------------------------------------------
+// Does this index answer questions about a position?
+//
+// Input:
+//   pos:     The position in file1
+//   aPhase:  The position in file2 that lines up with 0 in file1
+
+bool DiffIndex::covers(FPos pos, FPos aPhase)
+{
+  lock_guard<mutex>  guard(lock);
+
+  return (aPhase == phase && pos >= start &&
+          (running || done || pos < scanned));
+} // end DiffIndex::covers
+
+//--------------------------------------------------------------------
+// Find the next difference:
+//
+// If the scan hasn't found one yet, waits until it does (or finishes).
+//
+// Input:
+//   pos:  The position in file1 to start looking (must be covered)
+//
+// Output:
+//   diff:  The position in file1 of the next difference at or after
+//          pos, or where both files end if there isn't one
+//
+// Returns:
+//   1 if a difference was found
+//   0 if there are no more differences
+//  -1 if the scan stopped without getting that far
+
+int DiffIndex::findNext(FPos pos, FPos& diff)
+{
+  unique_lock<mutex>  guard(lock);
+
+  for (;;) {
+    const RangeVec::const_iterator  r = upper_bound(ranges.begin(),
+                                                    ranges.end(),
+                                                    pos, endsAfter);
+    if (r != ranges.end()) {
+      diff = max(r->first, pos);
+      return 1;
+    }
+
+    if (done) {
+      diff = end;
+      return 0;
+    }
+
+    if (!running) return -1;
+
+    wake.wait(guard);
+  } // end forever
+} // end DiffIndex::findNext
+
+//--------------------------------------------------------------------
+// Find the previous difference:
+//
+// If the scan hasn't reached pos yet, waits until it does (or stops).
+//
+// Input:
+//   pos:  The position in file1 to look before (must be covered)
+//
+// Output:
+//   diff:  The position in file1 of the last difference before pos,
+//          or where both files begin if there isn't one.
+//          If we return -1, the position to start scanning back from.
+//
+// Returns:
+//   1 if a difference was found
+//   0 if there are no differences before pos
+//  -1 if the scan doesn't cover everything before pos
+
+int DiffIndex::findPrevious(FPos pos, FPos& diff)
+{
+  unique_lock<mutex>  guard(lock);
+
+  while (running && scanned < pos)
+    wake.wait(guard);
+
+  if (scanned < pos) {
+    diff = pos;                 // The scan stopped short
+    return -1;
+  }
+
+  RangeVec::const_iterator  r = lower_bound(ranges.begin(), ranges.end(),
+                                            pos, startsBefore);
+  if (r != ranges.begin()) {
+    --r;
+    diff = min(r->second, pos) - 1;
+    return 1;
+  }
+
+  diff = start;
+
+  return ((start > max(FPos(0), -phase)) ? -1 : 0);
+} // end DiffIndex::findPrevious
+
+//--------------------------------------------------------------------
+// Record a difference:
+//
+// The caller must hold lock, and add ranges in order.
+
+void DiffIndex::addRange(FPos rangeStart, FPos rangeEnd)
+{
+  if (!ranges.empty() && rangeStart - ranges.back().second < lineWidth)
+    ranges.back().second = rangeEnd;
+  else
+    ranges.push_back(Range(rangeStart, rangeEnd));
+} // end DiffIndex::addRange
+
+//--------------------------------------------------------------------
+// Merge the finished blocks that come next:
+//
+// The caller must hold lock.
+
+void DiffIndex::merge()
+{
+  ChunkMap::iterator  chunk;
+
+  while ((chunk = finished.find(scanned)) != finished.end()) {
+    const RangeVec&  found = chunk->second.found;
+
+    for (VecSize r = 0; r < found.size(); ++r)
+      addRange(found[r].first, found[r].second);
+
+    scanned = chunk->second.end;
+    finished.erase(chunk);
+  } // end while the next block is finished
+
+  if (ranges.size() >= VecSize(maxDiffRanges))
+    limit = min(limit, scanned); // That's all we have room for
+} // end DiffIndex::merge
+
+//--------------------------------------------------------------------
+// Compare the files (runs in each worker thread):
+
+void DiffIndex::run()
+{
+  vector<Byte>  buf1(scanBlockSize), buf2(scanBlockSize);
+  RangeVec      found;
+
+  unique_lock<mutex>  guard(lock);
+
+  const FPos  window = FPos(workers.size()) * 2 * scanBlockSize;
+
+  for (;;) {
+    while (!stopping && claimed < limit && claimed - scanned >= window)
+      wake.wait(guard);         // Don't get too far ahead
+
+    if (stopping || claimed >= limit) break;
+
+    const FPos  pos   = claimed;
+    const FPos  block = pos / scanBlockSize;
+    const Size  want  = Size(min(scanBlockSize - pos % scanBlockSize,
+                                 shared - pos));
+
+    if (hashing) {
+      // If the HashTrees are complete, skip every block that's the same:
+      const FPos  next = file1->hashes->firstDifference(*file2->hashes,
+                                                        block);
+      if (next > block) {
+        claimed = min(next * scanBlockSize, shared);
+        finished[pos].end = claimed;
+        merge();
+        wake.notify_all();
+        continue;
+      }
+    } // end if hashing
+
+    claimed += want;
+
+    guard.unlock();
+
+    const bool  hole = (inHole(file1, pos, pos + want) &&
+                        inHole(file2, pos + phase, pos + phase + want));
+    bool  same  = hole;         // Two holes are both zeros
+    bool  read1 = hole, read2 = hole;
+    Size  got1  = want, got2 = want;
+
+    if (!same && hashing) {
+      // Hash whichever file hasn't been hashed yet; if the hashes
+      // match, we don't need to read the other one:
+      BlockHash  hash1, hash2;
+
+      same = (hashBlock(file1, pos, want, &buf1[0], got1, read1, hash1) &&
+              hashBlock(file2, pos, want, &buf2[0], got2, read2, hash2) &&
+              hash1 == hash2);
+    } // end if hashing
+
+    if (!same) {
+      if (!read1) got1 = file1->readDirect(pos, &buf1[0], want);
+      if (!read2) got2 = file2->readDirect(pos + phase, &buf2[0], want);
+    }
+
+    if (!same && got1 == want && got2 == want) {
+      const Byte*  b1 = &buf1[0];
+      const Byte*  b2 = &buf2[0];
+
+      Size  i = 0;
+
+      while ((i += firstMismatch(b1 + i, b2 + i, want - i)) < want) {
+        Size  j = i + 1;
+        while (j < want && b1[j] != b2[j])
+          ++j;
+
+        found.push_back(Range(pos + i, pos + j));
+        i = j;
+      } // end while more differences in this block
+    } // end if read the whole block
+
+    guard.lock();
+
+    if (got1 == want && got2 == want) {
+      Chunk&  chunk = finished[pos];
+      chunk.end = pos + want;
+      chunk.found.swap(found);
+      merge();
+    } else
+      limit = min(limit, pos);  // Read error; stop here
+
+    wake.notify_all();
+  } // end forever
+
+  if (--active) return;         // The last worker out finishes up
+
+  if (scanned >= shared) {
+    // Whatever is left is only in one file:
+    if (end > shared) addRange(max(shared, start), end);
+    scanned = end;
+    done    = true;
+  }
+
+  running = false;
+  wake.notify_all();
+} // end DiffIndex::run
+
+//--------------------------------------------------------------------
+// Get the hash of a block, reading and hashing it if we must:
+//
+// Called from the worker threads.  Only whole blocks are hashed.
+//
+// Input:
+//   f:       The file
+//   pos:     The position to compare from
+//   count:   The number of bytes to compare
+//   buffer:  Where to read them, if we have to
+//
+// Output:
+//   got:   The number of bytes read (if read is set)
+//   read:  Set to true if we read the bytes into buffer
+//   hash:  The hash of the block containing pos
+//
+// Returns:
+//   true if we know the block's hash
+
+bool DiffIndex::hashBlock(FileDisplay* f, FPos pos, Size count, Byte* buffer,
+                          Size& got, bool& read, BlockHash& hash)
+{
+  HashTree*   tree  = f->hashes;
+  const FPos  block = pos / scanBlockSize;
+
+  if (tree->getBlock(block, hash)) return true;
+
+  if (pos % scanBlockSize || count != tree->blockLength(block))
+    return false;               // Not a whole block
+
+  got  = f->readDirect(pos, buffer, count);
+  read = true;
+
+  if (got != count) return false;
+
+  hash = hashData(buffer, count);
+  tree->setBlock(block, hash);
+
+  return true;
+} // end DiffIndex::hashBlock
+
+//--------------------------------------------------------------------
+// Is a range entirely inside a hole?
+//
+// Called from the worker threads, so this asks the source directly
+// instead of using the FileDisplay's extent cache.
+
+bool DiffIndex::inHole(const FileDisplay* f, FPos pos, FPos end)
+{
+  FPos  holeEnd;
+
+  return (f->source->findHole(pos, holeEnd) && holeEnd >= end);
+} // end DiffIndex::inHole
+
+//--------------------------------------------------------------------
+// Stop looking for differences in the background:
+//
+// The DiffIndex workers read the files through their sources, so this
+// must be done before a file is written or its source is replaced.
+
+void discardDiffIndex()
+{
+  delete diffIndex;
+  diffIndex = NULL;
+} // end discardDiffIndex
+
+//====================================================================
+// Class FileDisplay:
+//
+// Member Variables:
+//   bufBad:
+//     The parts of the buffer that couldn't be read (start, end)
+//   bufContents:
+//     The number of bytes in the file buffer
+//   bufLoads:
+//     Counts the times the whole buffer has been read
+//     (Difference uses this to tell when it's only been scrolled)
+//   cache:
+//     Recently read blocks of the file (not used when it's mapped)
+//   diffs:
+//     A pointer to the Difference object related to this file
+//   edits:
+//     Bytes that have been changed but not saved, by file position
+//     (The display, diffs, and searches all see these.)
+//   extentStart/extentEnd:
+//     The part of the file we last asked the OS about (see holeEnd)
+//   extentHole:
+//     True if the extent is a hole in a sparse file
+//   file:
+//     The file being displayed
+//   fileName:
+//     The relative pathname of the file being displayed
+//   fileSize:
+//     The size of the file, or -1 if we haven't asked yet
+//     (Only used when the file isn't mapped)
+//     For a compressed file, this is the uncompressed size
+//   hashes:
+//     The hashes of the file's blocks (see --hash-cache),
+//     or NULL if we're not keeping them
+//   mapping:
+//     The entire file mapped into memory, or NULL if it couldn't be
+//     mapped (in which case we read it through cache)
+//   mapSize:
+//     The number of bytes in mapping
+//   offset:
+//     The position in the file of the first byte in the buffer
+//   readahead:
+//     Reads ahead of offset during a scan, or NULL if not scanning
+//   source:
+//     Where cache gets its data: the file itself, or a decompressor
+//     for a compressed file (NULL for a pipe)
+//   stream:
+//     Buffers the file if it's a pipe, or NULL if we can seek in it
+//   win:
+//     The handle of the window used for display
+//   yPos:
+//     The vertical position of the display window
+//   buffer/line:
+//     The currently displayed portion of the file
+//
+//--------------------------------------------------------------------
+// Constructor:
+
+FileDisplay::FileDisplay()
+: backup(NULL),
+  bufContents(0),
+  bufLoads(0),
+  data(NULL),
+  diffs(NULL),
+  extentStart(0),
+  extentEnd(0),
+  extentHole(false),
+  file(InvalidFile),
+  fileSize(-1),
+  hashes(NULL),
+  mapping(NULL),
+  mapSize(0),
+  offset(0),
+  readahead(NULL),
+  source(NULL),
+  stream(NULL),
+  writable(false),
+  yPos(0)
+{
+  fileName[0] = '\0';
+} // end FileDisplay::FileDisplay
+
+//--------------------------------------------------------------------
+// Initialize:
+//
+// Creates the display window and opens the file.
+//
+// Input:
+//   y:          The vertical position of the display window
+//   aDiff:      The Difference object related to this buffer
+//   aFileName:  The name of the file to display
+
+void FileDisplay::init(int y, const Difference* aDiff,
+                       const char* aFileName)
+{
+  diffs = aDiff;
+  yPos  = y;
+
+  win.init(0,y, screenWidth, (numLines + 1 + ((y==0) ? linesBetween : 0)),
+           cFileWin);
+
+  resize();
+
+  if (aFileName)
+    setFile(aFileName);
+} // end FileDisplay::init
+
+//--------------------------------------------------------------------
+// Destructor:
+
+FileDisplay::~FileDisplay()
+{
+  shutDown();
+  stopReadahead();
+  delete backup;
+  delete hashes;
+  cache.reset(NULL);
+  delete source;
+  delete stream;
+  if (mapping) UnmapFile(mapping, mapSize);
+  if (file != InvalidFile) CloseFile(file);
+  delete [] reinterpret_cast<Byte*>(data);
+} // end FileDisplay::~FileDisplay
+
+//--------------------------------------------------------------------
+void FileDisplay::resize()
+{
+  if (data)
+    delete [] reinterpret_cast<Byte*>(data);
+
+  data = reinterpret_cast<FileBuffer*>(new Byte[bufSize]);
+  bufContents = 0;
+
+  // FIXME resize window
+} // end FileDisplay::resize
+
+//--------------------------------------------------------------------
+// Shut down the file display:
+//
+// Deletes the display window.
+
+void FileDisplay::shutDown()
+{
+  win.close();
+} // end FileDisplay::shutDown
+
 //--------------------------------------------------------------------
 // Display the file contents:
 
@@ -460,7 +4645,7 @@ void FileDisplay::display()
   FPos  lineOffset = offset;
 
   short i,j,index,lineLength;
-  char  buf[lineWidth + lineWidth/8 + 1];
+  char  buf[lineWidth + lineWidth/8];
   buf[sizeof(buf)-1] = '\0';
 
   char  buf2[screenWidth+1];
@@ -468,11 +4653,17 @@ void FileDisplay::display()
 
   memset(buf, ' ', sizeof(buf)-1);
 
+  // Show the file name, and whether it has unsaved changes:
+  String  title(fileName);
+  if (!edits.empty()) title += " (modified)";
+  if (!bufBad.empty()) title += " (unreadable data)";
+  title.resize(screenWidth, ' ');
+  win.put(0,0, title.c_str());
+
   for (i = 0; i < numLines; i++) {
 //    cerr << i << '\n';
     char*  str = buf2;
-    str +=
-      sprintf(str, "%04X %04X:",Word(lineOffset>>16),Word(lineOffset&0xFFFF));
+    str += formatOffset(str, lineOffset);
 
     lineLength  = min(lineWidth, bufContents - i*lineWidth);
 
@@ -492,12 +4683,42 @@ void FileDisplay::display()
     win.put(0,i+1, buf2);
     win.put(leftMar2,i+1, buf);
 
-    if (diffs)
-      for (j = 0; j < lineWidth; j++)
-        if (diffs->data->line[i][j]) {
-          win.putAttribs(j*3 + leftMar  + (j>7),i+1, cFileDiff,2);
-          win.putAttribs(j   + leftMar2 + (j>7),i+1, cFileDiff,1);
-        }
+    // Highlight each run of differences:
+    const int  lineStart = i * lineWidth;
+    const int  lineEnd   = (diffs ? min(lineStart + lineWidth,
+                                        diffs->table.size()) : 0);
+
+    for (int run = lineStart;
+         run < lineEnd && (run = diffs->table.findSet(run)) < lineEnd;) {
+      const short  first = short(run - lineStart);
+      run = min(diffs->table.findClear(run), lineEnd);
+      const short  last  = short(run - lineStart);
+      const short  mid   = max(first, short(8)); // Start of 2nd half
+
+      for (j = first; j < last; j++)
+        win.putAttribs(j*3 + leftMar + (j>7),i+1, cFileDiff,2);
+
+      if (first < 8)
+        win.putAttribs(first + leftMar2,i+1, cFileDiff,min(last, mid) - first);
+      if (last > 8)
+        win.putAttribs(mid + leftMar2 + 1,i+1, cFileDiff, last - mid);
+    } // end for each run of differences
+
+    for (VecSize r = 0; r < bufBad.size(); ++r)
+      for (j = max(0, bufBad[r].first - i*lineWidth);
+           j < min(int(lineLength), bufBad[r].second - i*lineWidth); ++j) {
+        win.put(j*3 + leftMar  + (j>7),i+1, "??");
+        win.put(j   + leftMar2 + (j>7),i+1, "?");
+        win.putAttribs(j*3 + leftMar  + (j>7),i+1, cFileBad,2);
+        win.putAttribs(j   + leftMar2 + (j>7),i+1, cFileBad,1);
+      }
+
+    for (EditConstItr e = edits.lower_bound(lineOffset);
+         e != edits.end() && e->first < lineOffset + lineLength; ++e) {
+      j = short(e->first - lineOffset);
+      win.putAttribs(j*3 + leftMar  + (j>7),i+1, cFileEdit,2);
+      win.putAttribs(j   + leftMar2 + (j>7),i+1, cFileEdit,1);
+    }
     lineOffset += lineWidth;
   } // end for i up to numLines
 
@@ -507,6 +4728,10 @@ void FileDisplay::display()
 //--------------------------------------------------------------------
 // Edit the file:
 //
+// The changes aren't written to the file until you save them; until
+// then, they're kept in edits.  Each edit session can be undone as a
+// unit.
+//
 // Returns:
 //   true:  File changed
 //   false:  File did not change
@@ -516,13 +4741,9 @@ bool FileDisplay::edit(const FileDisplay* other)
   if (!bufContents && offset)
     return false;               // You must not be completely past EOF
 
-  if (!writable) {
-    File w = OpenFile(fileName, true);
-    if (w == InvalidFile) return false;
-    CloseFile(file);
-    file = w;
-    writable = true;
-  }
+  if (!makeWritable())
+    return false;               // You can't write to a pipe or a
+                                // compressed file
 
   if (bufContents < bufSize)
     memset(data->buffer + bufContents, 0, bufSize - bufContents);
@@ -531,9 +4752,10 @@ bool FileDisplay::edit(const FileDisplay* other)
   short y = 0;
   bool  hiNib = true;
   bool  ascii = false;
-  bool  changed = false;
   int   key;
 
+  ChangeVec  changes;
+
   const Byte *const inputTable = ((displayTable == ebcdicDisplayTable)
                                   ? ascii2ebcdicTable
                                   : NULL); // No translation
@@ -588,10 +4810,9 @@ bool FileDisplay::edit(const FileDisplay* other)
              newByte |= 0xF0 & data->line[y][x];
          } // end if valid digit entered
        } // end else hex
-       if (newByte >= 0) {
-         changed = true;
-         setByte(x,y,newByte);
-       } else
+       if (newByte >= 0)
+         setByte(x,y,newByte, changes);
+       else
          break;
      } // end default and fall thru
      case KEY_RIGHT:
@@ -606,33 +4827,457 @@ bool FileDisplay::edit(const FileDisplay* other)
       // else fall thru
      case KEY_DOWN: if (++y >= numLines) y = 0;  break;
 
-    } // end switch
+    } // end switch
+
+  } // end forever
+
+ done:
+  const bool  changed = !changes.empty();
+
+  if (changed) {
+    undoList.push_back(changes);
+    redoList.clear();
+  }
+
+  showPrompt();
+  ConWindow::hideCursor();
+  return changed;
+} // end FileDisplay::edit
+
+//--------------------------------------------------------------------
+// Change a byte without saving it:
+//
+// Input:
+//   pos:    The file position of the byte
+//   value:  The new value, or -1 to go back to the byte in the file
+//
+// Returns:
+//   The previous value (-1 if the byte hadn't been changed)
+
+short FileDisplay::setEdit(FPos pos, short value)
+{
+  const EditItr  e = edits.find(pos);
+  short          before = -1;
+
+  if (e != edits.end()) {
+    before = e->second;
+    if (value < 0) edits.erase(e);
+  }
+
+  if (value >= 0) edits[pos] = Byte(value);
+
+  return before;
+} // end FileDisplay::setEdit
+
+//--------------------------------------------------------------------
+// Write the changes that haven't been saved:
+//
+// Each run of consecutive changed bytes is written with a single
+// positional write.  If a write fails, the changes are kept so you
+// can try again.
+//
+// Returns:
+//   true:   The changes were saved (or there weren't any)
+//   false:  An error occurred
+
+bool FileDisplay::save()
+{
+  if (edits.empty()) return true;
+  if (!writable)     return false; // edit makes sure it is
+
+  // Don't change anything until the backup is complete:
+  if (backup && !backup->finish()) return false;
+
+  discardDiffIndex();
+
+  bool          ok = true;
+  vector<Byte>  run;
+
+  for (EditConstItr e = edits.begin(); e != edits.end(); ) {
+    const FPos  start = e->first;
+
+    run.clear();
+    do {
+      run.push_back(e->second);
+    } while (++e != edits.end() && e->first == start + FPos(run.size()));
+
+    if (!WriteFileAt(file, start, &run[0], Size(run.size())))
+      ok = false;
+  } // end for each run of changes
+
+  if (ok) edits.clear();
+
+  reread();
+
+  return ok;
+} // end FileDisplay::save
+
+//--------------------------------------------------------------------
+// Reopen the file for writing:
+//
+// With --backup, this is where the backup is started.
+//
+// Returns:
+//   true:   The file is writable
+//   false:  It's a pipe, compressed, or can't be opened for writing
+
+bool FileDisplay::makeWritable()
+{
+  if (writable)       return true;
+  if (!isPlainFile()) return false;
+
+  File w = OpenFile(fileName, true);
+  if (w == InvalidFile) return false;
+
+  if (makeBackups && !backup) {
+    backup = new Backup;
+    if (!backup->start(fileName)) {
+      delete backup;
+      backup = NULL;
+      CloseFile(w);
+      return false;
+    }
+  }
+
+  discardDiffIndex();           // Its workers are using source
+
+  cache.reset(NULL);
+  delete source;
+  CloseFile(file);
+  file = w;
+  source = new FileSource(file);
+  cache.reset(source);
+  fileSize = -1;
+  writable = true;
+
+  return true;
+} // end FileDisplay::makeWritable
+
+//--------------------------------------------------------------------
+// Make sure we can write to the file right now:
+//
+// Unlike edit, which only changes edits, this waits for any backup
+// to finish, and stops the DiffIndex from reading the file.
+
+bool FileDisplay::readyToWrite()
+{
+  if (!makeWritable() || (backup && !backup->finish())) return false;
+
+  discardDiffIndex();
+
+  return true;
+} // end FileDisplay::readyToWrite
+
+//--------------------------------------------------------------------
+// Forget what we've read, because the file was written:
+
+void FileDisplay::reread()
+{
+  discardDiffIndex();           // It doesn't know about the changes
+
+  if (hashes) {                 // Nor do the hashes
+    hashes->discard();
+    delete hashes;
+    hashes = openHashTree(file);
+  }
+
+  cache.reset(source);
+  fileSize = -1;
+  extentEnd = extentStart;      // We may have filled in a hole
+  mapFile();                    // The file may have grown
+  moveTo(offset);
+} // end FileDisplay::reread
+
+//--------------------------------------------------------------------
+// Check for unsaved changes in part of the file:
+
+bool FileDisplay::hasEdits(FPos pos, FPos length) const
+{
+  const EditConstItr  e = edits.lower_bound(pos);
+
+  return (e != edits.end() && e->first < pos + length);
+} // end FileDisplay::hasEdits
+
+//--------------------------------------------------------------------
+// Copy part of the file into another file:
+//
+// When we can, the kernel copies the data without it passing through
+// our buffers.  A pipe, a compressed file, or a range with unsaved
+// changes is read through readData instead, so you get exactly what
+// is displayed.
+//
+// Input:
+//   dest:     The file to copy into
+//   destPos:  Where to put the data in dest
+//   pos:      Where the data starts in this file
+//   length:   The number of bytes to copy
+//
+// Returns:
+//   true:   The data was copied (stopping early at EOF)
+//   false:  An error occurred
+
+bool FileDisplay::copyTo(File dest, FPos destPos, FPos pos, FPos length)
+{
+  const bool    direct = isPlainFile() && !hasEdits(pos, length);
+  vector<Byte>  buf(direct ? 0 : cacheBlockSize);
+
+  while (length > 0) {
+    Size  count = Size(min(length, FPos(copyChunk)));
+
+    if (direct)
+      count = CopyFileRange(file, pos, dest, destPos, count);
+    else {
+      count = readData(pos, &buf[0], min(count, Size(buf.size())));
+      if (count > 0 && !WriteFileAt(dest, destPos, &buf[0], count))
+        return false;
+    }
+
+    if (count < 0)  return false;
+    if (count == 0) break;      // EOF
+
+    pos     += count;
+    destPos += count;
+    length  -= count;
+  } // end while more to copy
+
+  return true;
+} // end FileDisplay::copyTo
+
+//--------------------------------------------------------------------
+// Copy part of the other file over this one:
+//
+// The data is written directly to the file, not kept in edits, so it
+// can't be undone.  The two files are aligned as displayed; if you've
+// moved one of them, the data comes from the matching position.
+//
+// Input:
+//   other:   The file to copy from
+//   pos:     Where the range starts in this file
+//   length:  The number of bytes to copy
+//
+// Returns:
+//   true:   The data was copied
+//   false:  An error occurred
+
+bool FileDisplay::copyFrom(FileDisplay& other, FPos pos, FPos length)
+{
+  if (!readyToWrite()) return false;
+
+  const bool  ok = other.copyTo(file, pos, pos + other.offset - offset,
+                                length);
+  reread();
+
+  return ok;
+} // end FileDisplay::copyFrom
+
+//--------------------------------------------------------------------
+// Fill part of the file with a repeated pattern:
+//
+// We write the pattern once (repeated to fill a cache block), and
+// then have the kernel copy what's already filled to the rest, so
+// each copy can be twice the size of the last.  Like copyFrom, this
+// writes directly to the file.
+//
+// Input:
+//   pos:         Where the range starts
+//   length:      The number of bytes to fill
+//   pattern:     The bytes to fill it with
+//   patternLen:  The length of pattern
+//
+// Returns:
+//   true:   The range was filled
+//   false:  An error occurred
+
+bool FileDisplay::fill(FPos pos, FPos length, const Byte* pattern,
+                       int patternLen)
+{
+  if (!readyToWrite()) return false;
+
+  vector<Byte>  block;
+  const int     repeat = max(1, cacheBlockSize / patternLen);
+
+  for (int i = 0; i < repeat; ++i)
+    block.insert(block.end(), pattern, pattern + patternLen);
+
+  FPos  done = min(length, FPos(block.size()));
+  bool  ok   = WriteFileAt(file, pos, &block[0], Size(done));
+
+  while (ok && done < length) {
+    // The source must start at the same point in the pattern:
+    const FPos  skew  = done % FPos(block.size());
+    const Size  count = CopyFileRange(file, pos + skew, file, pos + done,
+                                      Size(min(min(length - done, done - skew),
+                                               FPos(copyChunk))));
+    if (count <= 0)
+      ok = false;
+    else
+      done += count;
+  } // end while more to fill
+
+  reread();
+
+  return ok;
+} // end FileDisplay::fill
+
+//--------------------------------------------------------------------
+// Map the file into memory:
+//
+// Replaces any existing mapping.  If the file can't be mapped,
+// mapping is left NULL and we fall back to reading it.
+
+void FileDisplay::mapFile()
+{
+  if (mapping) {
+    UnmapFile(mapping, mapSize);
+    mapping = NULL;
+    mapSize = 0;
+  }
+
+  // A read error in a mapped file would crash us:
+  if (tolerateErrors) return;
+
+  mapping = reinterpret_cast<const Byte*>(MapFile(file, mapSize));
+} // end FileDisplay::mapFile
 
-  } // end forever
+//--------------------------------------------------------------------
+// Bring a block of the file into memory:
+//
+// Called by the Readahead thread.  For a mapped file, this touches
+// each page of the block so the OS reads it in now, rather than when
+// the scan gets there.
+//
+// Input:
+//   pos:  The file position of the block (a multiple of cacheBlockSize)
+//
+// Returns:
+//   true:   The block contains data
+//   false:  The block is past EOF or could not be read
 
- done:
-  if (changed) {
-    promptWin.clear();
-    promptWin.border();
-    promptWin.put(30,1,"Save changes (Y/N):");
-    promptWin.update();
-    promptWin.setCursor(50,1);
-    key = promptWin.readKey();
-    if (safeUC(key) != 'Y') {
-      changed = false;
-      moveTo(offset);           // Re-read buffer contents
-    } else {
-      SeekFile(file, offset);
-      WriteFile(file, data->buffer, bufContents);
+bool FileDisplay::prefetch(FPos pos)
+{
+  if (stream)
+    return stream->prefetch(pos);
+
+  if (!mapping)
+    return cache.prefetch(pos);
+
+  if (pos >= mapSize) return false;
+
+  const Byte*        p   = mapping + pos;
+  const Byte *const  end = mapping + min(mapSize, pos + cacheBlockSize);
+  volatile Byte      sink;
+
+  for (; p < end; p += 4096)
+    sink = *p;
+
+  (void) sink;
+
+  return true;
+} // end FileDisplay::prefetch
+
+//--------------------------------------------------------------------
+// Read from the file without going through the cache:
+//
+// Unlike readData, this may be called from another thread, as long
+// as the file is a plain file and isn't being changed.  It doesn't
+// include unsaved changes.
+//
+// Input:
+//   pos:     The file position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size FileDisplay::readDirect(FPos pos, Byte* buffer, Size count)
+{
+  if (!mapping)
+    return source->read(pos, buffer, count);
+
+  if (pos >= mapSize) return 0;
+
+  count = Size(min(FPos(count), mapSize - pos));
+  memcpy(buffer, mapping + pos, count);
+
+  return count;
+} // end FileDisplay::readDirect
+
+//--------------------------------------------------------------------
+// Read from the file, including any unsaved changes:
+//
+// Input:
+//   pos:     The file position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size FileDisplay::readData(FPos pos, Byte* buffer, Size count)
+{
+  Size  length = readUnedited(pos, buffer, count);
+
+  for (EditConstItr e = edits.lower_bound(pos);
+       e != edits.end() && e->first < pos + count; ++e) {
+    const Size  i = Size(e->first - pos);
+
+    if (i >= length) {
+      // Editing can add bytes at the end of the file:
+      if (length < 0) length = 0;
+      memset(buffer + length, 0, i - length);
+      length = i + 1;
     }
+
+    buffer[i] = e->second;
+  } // end for each change in range
+
+  return length;
+} // end FileDisplay::readData
+
+//--------------------------------------------------------------------
+// Read from the file, ignoring unsaved changes:
+//
+// Uses the StreamBuffer for a pipe, the source itself if its data
+// can change under us, otherwise the mapping if we have one, and the
+// cache otherwise.  A hole in a sparse file is just filled with
+// zeros.  During an uncached scan (see Readahead), the cache is used
+// even if the file is mapped.
+//
+// Input:
+//   pos:     The file position to read from
+//   buffer:  Where to store the data
+//   count:   The number of bytes to read
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size FileDisplay::readUnedited(FPos pos, Byte* buffer, Size count)
+{
+  if (stream)
+    return stream->read(pos, buffer, count);
+
+  if (holeEnd(pos) - pos >= count) {
+    memset(buffer, 0, count);   // No need to read a hole
+    return count;
   }
-  showPrompt();
-  ConWindow::hideCursor();
-  return changed;
-} // end FileDisplay::edit
+
+  if (source && source->isVolatile())
+    return source->read(pos, buffer, count); // Don't cache live data
+
+  if (!mapping || (readahead && readahead->isDirect()))
+    return cache.read(pos, buffer, count);
+
+  if (pos >= mapSize) return 0;
+
+  count = Size(min(FPos(count), mapSize - pos));
+  memcpy(buffer, mapping + pos, count);
+
+  return count;
+} // end FileDisplay::readUnedited
 
 //--------------------------------------------------------------------
-void FileDisplay::setByte(short x, short y, Byte b)
+void FileDisplay::setByte(short x, short y, Byte b, ChangeVec& changes)
 {
   if (x + y*lineWidth >= bufContents) {
     if (x + y*lineWidth > bufContents) {
@@ -641,7 +5286,7 @@ void FileDisplay::setByte(short x, short y, Byte b)
       while (y1 <= numLines) {
         while (x1 < lineWidth) {
           if ((x1 == x) && (y1 == y)) goto done;
-          setByte(x1,y1,0);
+          setByte(x1,y1,0, changes);
           ++x1;
         }
         x1 = 0;
@@ -655,6 +5300,11 @@ void FileDisplay::setByte(short x, short y, Byte b)
 
   if (data->line[y][x] != b) {
     data->line[y][x] = b;
+
+    const FPos    pos = offset + x + y*lineWidth;
+    const Change  change = { this, pos, setEdit(pos, b), b };
+    changes.push_back(change);
+
     char str[3];
     sprintf(str, "%02X", b);
     win.setAttribs(cFileEdit);
@@ -686,6 +5336,10 @@ void FileDisplay::setByte(short x, short y, Byte b)
 // Changes the file offset and updates the buffer.
 // Does not update the display.
 //
+// When we move less than a screen, the bytes still on screen are
+// kept, and only the ones scrolling into view are read.  Moving to
+// the same offset reads the whole buffer again.
+//
 // Input:
 //   newOffset:
 //     The new position of the file
@@ -694,15 +5348,101 @@ void FileDisplay::moveTo(FPos newOffset)
 {
   if (!fileName[0]) return;     // No file
 
+  const FPos  oldOffset = offset;
+
   offset = newOffset;
 
   if (offset < 0)
     offset = 0;
 
-  SeekFile(file, offset);
-  bufContents = ReadFile(file, data->buffer, bufSize);
+  if (stream)
+    offset = max(offset, stream->earliest()); // Can't go back any further
+
+  if (readahead)
+    readahead->advance(offset);
+
+  // The bytes on screen can only be reused if they can't have changed:
+  const FPos  shift = offset - oldOffset;
+  bool        reload = (bufContents != bufSize ||
+                        shift == 0 || shift <= -bufSize || shift >= bufSize ||
+                        (source && source->isVolatile()));
+
+  if (reload)
+    ;
+  else if (shift > 0) {
+    // Scroll forwards, then read the end of the buffer:
+    const int  keep = bufSize - int(shift);
+    memmove(data->buffer, data->buffer + shift, keep);
+
+    const Size  bytesRead = readData(offset + keep, data->buffer + keep,
+                                     bufSize - keep);
+    bufContents = (bytesRead < 0 ? -1 : keep + int(bytesRead));
+  } else {
+    // Scroll backwards, then read the start of the buffer:
+    memmove(data->buffer - shift, data->buffer, bufSize + shift);
+
+    reload = (readData(offset, data->buffer, -shift) != -shift);
+  }
+
+  if (reload) {
+    bufContents = readData(offset, data->buffer, bufSize);
+    ++bufLoads;
+  }
+
+  // Note which bytes (if any) couldn't be read:
+  bufBad.clear();
+
+  FPos  start, end;
+
+  for (FPos pos = offset;
+       source && pos < offset + bufContents &&
+         source->findBad(pos, start, end) && start < offset + bufContents;
+       pos = end)
+    bufBad.push_back(make_pair(int(max(start, offset) - offset),
+                               int(min(end, offset + bufContents) - offset)));
 } // end FileDisplay::moveTo
 
+//--------------------------------------------------------------------
+// Skip over data that couldn't be read:
+//
+// Input:
+//   pos:     The start of the range to check
+//   length:  The length of the range
+//
+// Returns:
+//   The end of the unreadable data overlapping the range,
+//   or pos if all of it could be read
+
+FPos FileDisplay::badEnd(FPos pos, FPos length)
+{
+  FPos  start, end;
+
+  if (source && source->findBad(pos, start, end) && start < pos + length)
+    return end;
+
+  return pos;
+} // end FileDisplay::badEnd
+
+//--------------------------------------------------------------------
+// Skip backwards over data that couldn't be read:
+//
+// Input:
+//   pos:  The position to check
+//
+// Returns:
+//   The start of the unreadable data containing pos,
+//   or pos + 1 if pos could be read
+
+FPos FileDisplay::badStart(FPos pos)
+{
+  FPos  start, end;
+
+  if (source && source->findBad(pos, start, end) && start <= pos)
+    return start;
+
+  return pos + 1;
+} // end FileDisplay::badStart
+
 //--------------------------------------------------------------------
 // Change the file position by searching:
 //
@@ -733,6 +5473,45 @@ bool FileDisplay::moveTo(const Byte* searchFor, int searchLen)
   for (i = 0; i < searchLen; ++i)
     moveOver[searchFor[i]] = searchLen - i;
 
+  // Unless we're looking for zeros, a match can't be inside a hole:
+  bool  skipHoles = false;
+
+  for (i = 0; i < searchLen; ++i)
+    if (searchFor[i]) skipHoles = true;
+
+  if (mapping && edits.empty()) {
+    // Search the mapped file in place:
+    const FPos  start = offset + 1;
+
+    if (start + searchLen > mapSize) return false;
+
+    const Byte*        p    = mapping + start;
+    const Byte *const  last = mapping + mapSize - searchLen;
+    FPos               checkHole = start; // When to look for a hole
+
+    for (;;) {
+      if (skipHoles && p - mapping >= checkHole) {
+        // Jump to the first place a match could end past the hole:
+        const FPos  resume = holeEnd(p - mapping) - searchLen + 1;
+
+        if (resume > p - mapping) {
+          if (resume > last - mapping) return false;
+          p = mapping + resume;
+        }
+        checkHole = (p - mapping) + cacheBlockSize;
+      } // end if time to look for a hole
+
+      if (memcmp(searchFor, p, searchLen) == 0) {
+        moveTo(p - mapping);
+        return true;
+      }
+      if (p == last) return false;
+
+      p += moveOver[p[searchLen]]; // shift
+      if (p > last) return false;
+    } // end forever
+  } // end if file is mapped
+
   // Prepare the search buffer:
 
   const int
@@ -746,12 +5525,11 @@ bool FileDisplay::moveTo(const Byte* searchFor, int searchLen)
   Byte *const  copyTo         = searchBuf + restartAt;
   const Byte *const copyFrom  = searchBuf + fullStop;
 
-  char *const  readAt = reinterpret_cast<char*>(searchBuf) + blockSize;
+  Byte *const  readAt = searchBuf + blockSize;
 
   FPos  newPos = offset + 1;
 
-  SeekFile(file, newPos);
-  Size bytesRead = ReadFile(file, searchBuf, blockSize * 2);
+  Size bytesRead = readData(newPos, searchBuf, blockSize * 2);
   int stopAt = bytesRead - moveLength;
 
   // Start the search:
@@ -760,7 +5538,8 @@ bool FileDisplay::moveTo(const Byte* searchFor, int searchLen)
     if (stopAt < fullStop) ++stopAt;
 
     while (i < stopAt) {
-      if (memcmp(searchFor, searchBuf + i, searchLen) == 0)
+      if (memcmp(searchFor, searchBuf + i, searchLen) == 0 &&
+          badEnd(newPos + i, searchLen) == newPos + i)
         goto done;
 
       i += moveOver[searchBuf[i + searchLen]]; // shift
@@ -773,13 +5552,34 @@ bool FileDisplay::moveTo(const Byte* searchFor, int searchLen)
 
     newPos += blockSize;
     i -= blockSize;
+
+    if (skipHoles) {
+      // If we're at a big hole, start over just before its end:
+      const FPos  resume = holeEnd(newPos + i) - searchLen + 1;
+
+      if (resume - (newPos + i) > 2 * blockSize) {
+        newPos = resume;
+        i = 0;
+        bytesRead = readData(newPos, searchBuf, blockSize * 2);
+        stopAt = bytesRead - moveLength;
+        continue;
+      }
+    } // end if skipping holes
+
+    // Start reading ahead once it looks like this will take a while:
+    if (readahead)
+      readahead->advance(newPos);
+    else if (newPos - offset > cacheBlockSize)
+      startReadahead();
+
     memcpy(copyTo, copyFrom, moveLength);
-    bytesRead = ReadFile(file, readAt, blockSize);
+    bytesRead = readData(newPos + blockSize, readAt, blockSize);
     stopAt = bytesRead + blockSize - moveLength;
   } // end forever
 
  done:
   delete [] searchBuf;
+  stopReadahead();
 
   if (i < 0) return false;      // No match
 
@@ -788,6 +5588,154 @@ bool FileDisplay::moveTo(const Byte* searchFor, int searchLen)
   return true;
 } // end FileDisplay::moveTo
 
+//--------------------------------------------------------------------
+// Find the next difference from another file:
+//
+// Compares both files a block at a time, instead of a screen at a
+// time.  Parts where both files have holes are skipped without
+// reading them, and unreadable bytes don't count as differences.
+//
+// Input:
+//   other:  The file to compare with, lined up as displayed
+//   pos:    The position in this file to start looking
+//
+// Output:
+//   pos:  The position in this file of the next difference,
+//         or where both files end
+//
+// Returns:
+//   true if a difference was found
+
+bool FileDisplay::findDifference(FileDisplay& other, FPos& pos)
+{
+  if (!other.fileName[0]) return true; // Nothing to compare with
+
+  const FPos  phase = other.offset - offset;
+
+  vector<Byte>  buf1(scanBlockSize), buf2(scanBlockSize);
+  const Byte*   b1 = &buf1[0];
+  const Byte*   b2 = &buf2[0];
+
+  for (int blocks = 0; ; ++blocks) {
+    // Skip the part where both files have holes (so they're both all
+    // zeros), without even reading it:
+    pos = min(holeEnd(pos), other.holeEnd(pos + phase) - phase);
+
+    // Start reading ahead once it looks like this will take a while:
+    if (blocks == 1) {
+      startReadahead();
+      other.startReadahead();
+    }
+    if (readahead)       readahead->advance(pos);
+    if (other.readahead) other.readahead->advance(pos + phase);
+
+    const Size  got1 = readData(pos, &buf1[0], scanBlockSize);
+    const Size  got2 = other.readData(pos + phase, &buf2[0], scanBlockSize);
+
+    if (got1 < 0 || got2 < 0) return true; // Show where the error is
+
+    const Size  count = min(got1, got2);
+    Size        i     = 0;
+
+    while ((i += firstMismatch(b1 + i, b2 + i, count - i)) < count) {
+      // We don't know whether unreadable bytes are different:
+      const FPos  bad = max(badEnd(pos + i, 1),
+                            other.badEnd(pos + phase + i, 1) - phase);
+      if (bad == pos + i) {
+        pos += i;
+        return true;
+      }
+
+      i = Size(min(bad - pos, FPos(count)));
+    } // end while mismatches in this block
+
+    pos += count;
+
+    if (got1 != got2) return true; // Only one file continues past here
+    if (!count)       return false; // Both files end here
+  } // end forever
+} // end FileDisplay::findDifference
+
+//--------------------------------------------------------------------
+// Find the previous difference from another file:
+//
+// Like findDifference, but compares both files a block at a time
+// going backwards, checking each block from its end.
+//
+// Input:
+//   other:  The file to compare with, lined up as displayed
+//   pos:    The position in this file to look before
+//
+// Output:
+//   pos:  The position in this file of the last difference before pos,
+//         or where both files begin
+//
+// Returns:
+//   true if a difference was found
+
+bool FileDisplay::findPrevDifference(FileDisplay& other, FPos& pos)
+{
+  if (!other.fileName[0]) {     // Nothing to compare with
+    if (pos <= 0) return false;
+    --pos;
+    return true;
+  }
+
+  const FPos  phase = other.offset - offset;
+  const FPos  begin = max(FPos(0), -phase);
+  const FPos  size1 = getSize();
+  const FPos  size2 = other.getSize() - phase;
+
+  if (pos > min(size1, size2)) {
+    // Only one file continues past here:
+    pos = min(pos, max(size1, size2)) - 1;
+    return true;
+  }
+
+  vector<Byte>  buf1(scanBlockSize), buf2(scanBlockSize);
+  const Byte*   b1 = &buf1[0];
+  const Byte*   b2 = &buf2[0];
+
+  while (pos > begin) {
+    const FPos  blockStart = max(pos - scanBlockSize, begin);
+    const Size  count      = Size(pos - blockStart);
+
+    // Skip blocks where both files have holes, without reading them:
+    if (holeEnd(blockStart) >= pos &&
+        other.holeEnd(blockStart + phase) - phase >= pos) {
+      pos = blockStart;
+      continue;
+    }
+
+    const Size  got1 = readData(blockStart, &buf1[0], count);
+    const Size  got2 = other.readData(blockStart + phase, &buf2[0], count);
+
+    if (got1 != count || got2 != count) {
+      --pos;                    // Show where the error is
+      return true;
+    }
+
+    Size  i = count;
+
+    while ((i = lastMismatch(b1, b2, i)) > 0) {
+      // We don't know whether unreadable bytes are different:
+      const FPos  diff = blockStart + i - 1;
+      const FPos  bad  = min(badStart(diff),
+                             other.badStart(diff + phase) - phase);
+      if (bad > diff) {
+        pos = diff;
+        return true;
+      }
+
+      i = Size(max(bad - blockStart, FPos(0)));
+    } // end while mismatches in this block
+
+    pos = blockStart;
+  } // end while more to compare
+
+  return false;
+} // end FileDisplay::findPrevDifference
+
 //--------------------------------------------------------------------
 // Move to the end of the file:
 //
@@ -798,7 +5746,7 @@ void FileDisplay::moveToEnd(FileDisplay* other)
 {
   if (!fileName[0]) return;     // No file
 
-  FPos  end = SeekFile(file, 0, SeekEnd);
+  FPos  end = getSize();
   FPos  diff = 0;
 
   if (other) {
@@ -806,7 +5754,7 @@ void FileDisplay::moveToEnd(FileDisplay* other)
     // we want to keep them offset by the same amount:
     diff = other->offset - offset;
 
-    end = min(end, SeekFile(other->file, 0, SeekEnd) - diff);
+    end = min(end, other->getSize() - diff);
   } // end if moving other file too
 
   end -= steps[cmmMovePage];
@@ -817,39 +5765,270 @@ void FileDisplay::moveToEnd(FileDisplay* other)
 } // end FileDisplay::moveToEnd
 
 //--------------------------------------------------------------------
-// Open a file for display:
+// Get the size of the file:
+//
+// Includes any bytes added by editing.
+//
+// Returns:
+//   The size of the file, or -1 if it can't be determined
+
+FPos FileDisplay::getSize()
+{
+  if (stream) return stream->size();
+
+  if (mapping)
+    fileSize = mapSize;
+  else if (fileSize < 0)
+    fileSize = source->size();
+
+  return (edits.empty() ? fileSize
+          : max(fileSize, edits.rbegin()->first + 1));
+} // end FileDisplay::getSize
+
+//--------------------------------------------------------------------
+// Find the end of a hole in a sparse file:
+//
+// Remembers what the OS said, so calling this repeatedly as a scan
+// moves through the file is cheap.
+//
+// Input:
+//   pos:  The file position to check
+//
+// Returns:
+//   The position where the hole containing pos ends, or pos if it's
+//   not in a hole (or the file isn't a plain file)
+//   A hole ends early if there's an unsaved change in it.
+
+FPos FileDisplay::holeEnd(FPos pos)
+{
+  if (!source) return pos;
+
+  if (pos < extentStart || pos >= extentEnd) {
+    FPos  end;
+
+    extentHole  = source->findHole(pos, end);
+    extentStart = pos;
+    extentEnd   = ((end > pos) ? end : getSize());
+  }
+
+  if (!extentHole) return pos;
+
+  const EditConstItr  e = edits.lower_bound(pos);
+
+  return ((e != edits.end() && e->first < extentEnd) ? e->first : extentEnd);
+} // end FileDisplay::holeEnd
+
+//--------------------------------------------------------------------
+// Get the largest position the offset column may need to show:
+//
+// For a plain file, that's its size, so the column doesn't change
+// width as you move through the file.  Otherwise, we don't know the
+// size without reading the whole file, so it's the end of the buffer.
+
+FPos FileDisplay::lastOffset()
+{
+  if (!fileName[0]) return 0;   // No file
+
+  const FPos  end = offset + bufSize;
+
+  return (isPlainFile() ? max(end, getSize()) : end);
+} // end FileDisplay::lastOffset
+
+//--------------------------------------------------------------------
+// Open a file for display:
+//
+// Opens the file, updates the filename display, and reads the start
+// of the file into the buffer.
+//
+// Input:
+//   aFileName:  The name of the file to open
+//   aFile:      If not InvalidFile, the already open file to display
+//               (aFileName is then just for display)
+//
+// Returns:
+//   True:   Operation successful
+//   False:  Unable to open file (call ErrorMsg for error message)
+
+bool FileDisplay::setFile(const char* aFileName, File aFile)
+{
+  strncpy(fileName, aFileName, maxPath);
+  fileName[maxPath-1] = '\0';
+
+  win.put(0,0, fileName);
+  win.putAttribs(0,0, cFileName, screenWidth);
+  win.update();                 // FIXME
+
+  bufContents = 0;
+  fileSize = -1;
+  extentEnd = extentStart;
+  writable = false;
+
+  long  pid;
+
+  if (aFile == InvalidFile && isProcessName(fileName, pid)) {
+    const Process  process = OpenProcessMemory(pid);
+
+    if (process == InvalidProcess)
+      return false;
+
+    source = new ProcessSource(process);
+    cache.reset(source);
+    moveTo(0);
+
+    return true;
+  } // end if displaying a process
+
+  file = ((aFile != InvalidFile) ? aFile : OpenFile(fileName));
+
+  if (file == InvalidFile)
+    return false;
+
+  if (!IsSeekable(file))
+    stream = new StreamBuffer(file);
+  else {
+    // Join a split image, and display a compressed file uncompressed,
+    // unless asked not to.  (aFile is standard input, which has no
+    // name to find segments or keep an index by.)
+    if (joinSplits && aFile == InvalidFile)
+      source = openSplit(file, fileName);
+
+    if (!source && decompress && aFile == InvalidFile)
+      source = openCompressed(file, fileName);
+
+    if (!source) {
+      source = new FileSource(file);
+      hashes = openHashTree(file);
+      mapFile();
+    }
+    cache.reset(source);
+  }
+  moveTo(0);
+
+  return true;
+} // end FileDisplay::setFile
+
+//--------------------------------------------------------------------
+// Display a repeated pattern instead of a file:
+//
+// Input:
+//   aPattern:  The bytes to repeat
+//   length:    The size to make it (-1 means practically unlimited)
+
+void FileDisplay::setPattern(const String& aPattern, FPos length)
+{
+  pattern = aPattern;
+
+  String  title("Pattern");
+
+  for (String::size_type i = 0; i < pattern.size(); ++i) {
+    const Byte  b = Byte(pattern[i]);
+    title += ' ';
+    title += hexDigits[b >> 4];
+    title += hexDigits[b & 0x0F];
+  }
+
+  strncpy(fileName, title.c_str(), maxPath);
+  fileName[maxPath-1] = '\0';
+
+  win.put(0,0, fileName);
+  win.putAttribs(0,0, cFileName, screenWidth);
+
+  if (length < 0) length = numeric_limits<FPos>::max();
+
+  source = new PatternSource(pattern, length);
+  cache.reset(source);
+  moveTo(0);
+} // end FileDisplay::setPattern
+
+//--------------------------------------------------------------------
+// Find where the file stops matching a repeated pattern:
 //
-// Opens the file, updates the filename display, and reads the start
-// of the file into the buffer.
+// Used to find the next difference when comparing against a
+// PatternSource, without going through the file a page at a time.
+// If the pattern is all zeros, holes in a sparse file are skipped
+// without reading them.
 //
 // Input:
-//   aFileName:  The name of the file to open
+//   pos:       The position to start looking
+//   aPattern:  The pattern
+//   phase:     The position in the pattern that matches position 0
+//              in this file (it may be negative)
 //
 // Returns:
-//   True:   Operation successful
-//   False:  Unable to open file (call ErrorMsg for error message)
+//   The position of the first byte that doesn't match the pattern,
+//   or the end of the file
 
-bool FileDisplay::setFile(const char* aFileName)
+FPos FileDisplay::matchPattern(FPos pos, const String& aPattern, FPos phase)
 {
-  strncpy(fileName, aFileName, maxPath);
-  fileName[maxPath-1] = '\0';
+  const Size  patternLen = Size(aPattern.size());
+  const bool  zeros = (aPattern.find_first_not_of('\0') == String::npos);
+  const FPos  start = pos;
 
-  win.put(0,0, fileName);
-  win.putAttribs(0,0, cFileName, screenWidth);
-  win.update();                 // FIXME
+  // The pattern repeated, long enough that a block can start
+  // anywhere in the first repetition:
+  vector<Byte>  expected(cacheBlockSize + patternLen);
 
-  bufContents = 0;
-  file = OpenFile(fileName);
-  writable = false;
+  for (VecSize i = 0; i < expected.size(); ++i)
+    expected[i] = Byte(aPattern[i % patternLen]);
 
-  if (file == InvalidFile)
-    return false;
+  vector<Byte>  buf(cacheBlockSize);
 
-  offset = 0;
-  bufContents = ReadFile(file, data->buffer, bufSize);
+  phase = (phase % patternLen + patternLen) % patternLen;
 
-  return true;
-} // end FileDisplay::setFile
+  for (;;) {
+    if (zeros) {
+      const FPos  end = holeEnd(pos);
+      if (end > pos) {
+        pos = end;
+        continue;
+      }
+    } // end if holes match
+
+    // Start reading ahead once it looks like this will take a while:
+    if (readahead)
+      readahead->advance(pos);
+    else if (pos - start > cacheBlockSize)
+      startReadahead();
+
+    const Size  count = readData(pos, &buf[0], cacheBlockSize);
+    if (count <= 0) break;      // EOF
+
+    const Size  same = firstMismatch(&buf[0],
+                                     &expected[(pos + phase) % patternLen],
+                                     count);
+    pos += same;
+    if (same < count) {
+      // Found a difference, unless it's just unreadable:
+      const FPos  end = badEnd(pos, 1);
+      if (end == pos) break;
+      pos = end;
+    }
+  } // end forever
+
+  stopReadahead();
+
+  return pos;
+} // end FileDisplay::matchPattern
+
+//--------------------------------------------------------------------
+// Start reading ahead of the current position:
+//
+// Used when we're about to scan sequentially through the file.
+
+void FileDisplay::startReadahead()
+{
+  if (fileName[0] && !readahead)
+    readahead = new Readahead(this, offset);
+} // end FileDisplay::startReadahead
+
+//--------------------------------------------------------------------
+// Stop reading ahead:
+
+void FileDisplay::stopReadahead()
+{
+  delete readahead;
+  readahead = NULL;
+} // end FileDisplay::stopReadahead
 
 //====================================================================
 // Main Program:
@@ -1322,7 +6501,7 @@ void showPrompt()
 
 #ifdef WIN32_CONSOLE
   promptWin.put(1,1, "Arrow keys move  F find      "
-                "RET next difference  ESC quit  ALT  freeze top");
+                "RET/P next/prev diff ESC quit  ALT  freeze top");
   promptWin.put(1,2, "C ASCII/EBCDIC   E edit file   "
                 "G goto position      Q quit  CTRL freeze bottom");
   const short
@@ -1330,7 +6509,7 @@ void showPrompt()
     topLength    = 15;
 #else // curses
   promptWin.put(1,1, "Arrow keys move  F find      "
-                "RET next difference  ESC quit  T move top");
+                "RET/P next/prev diff ESC quit  T move top");
   promptWin.put(1,2, "C ASCII/EBCDIC   E edit file   "
                 "G goto position      Q quit  B move bottom");
   const short
@@ -1341,11 +6520,20 @@ void showPrompt()
   promptWin.putAttribs( 1,1, cPromptKey, 10);
   promptWin.putAttribs(18,1, cPromptKey, 1);
   promptWin.putAttribs(30,1, cPromptKey, 3);
+  promptWin.putAttribs(34,1, cPromptKey, 1);
   promptWin.putAttribs(51,1, cPromptKey, 3);
   promptWin.putAttribs( 1,2, cPromptKey, 1);
   promptWin.putAttribs(18,2, cPromptKey, 1);
   promptWin.putAttribs(32,2, cPromptKey, 1);
   promptWin.putAttribs(53,2, cPromptKey, 1);
+
+  promptWin.put(1,3, "U undo edit      R redo edit   W write changes"
+                "      X copy/fill range");
+  promptWin.putAttribs( 1,3, cPromptKey, 1);
+  promptWin.putAttribs(18,3, cPromptKey, 1);
+  promptWin.putAttribs(32,3, cPromptKey, 1);
+  promptWin.putAttribs(53,3, cPromptKey, 1);
+
   if (singleFile) {
     // Erase "move top" & "move bottom":
     promptWin.putChar(61,1, ' ', topLength);
@@ -1454,6 +6642,17 @@ Command getCommand()
       break;
 
      case 'C':  cmd = cmToggleASCII;  break;
+     case 'P':  cmd = cmPrevDiff;     break;
+     case 'R':  cmd = cmRedo;         break;
+     case 'U':  cmd = cmUndo;         break;
+     case 'W':  cmd = cmSave;         break;
+
+     case 'X':
+      if (e.dwControlKeyState & (LEFT_ALT_PRESSED|RIGHT_ALT_PRESSED))
+        cmd = cmRange|cmgGotoBottom;
+      else
+        cmd = cmRange|cmgGotoTop;
+      break;
 
      default:                 // Try extended codes
       switch (e.wVirtualKeyCode) {
@@ -1520,6 +6719,17 @@ Command getCommand()
       break;
 
      case 'C':  cmd = cmToggleASCII;  break;
+     case 'P':  cmd = cmPrevDiff;     break;
+     case 'R':  cmd = cmRedo;         break;
+     case 'U':  cmd = cmUndo;         break;
+     case 'W':  cmd = cmSave;         break;
+
+     case 'X':
+      if (lockState == lockTop)
+        cmd = cmRange|cmgGotoBottom;
+      else
+        cmd = cmRange|cmgGotoTop;
+      break;
 
      case 'B':  if (!singleFile) cmd = cmUseBottom;              break;
      case 'T':  if (!singleFile) cmd = cmUseTop;                 break;
@@ -1544,6 +6754,65 @@ Command getCommand()
 } // end getCommand
 #endif  // end else curses interface
 
+//--------------------------------------------------------------------
+// Look up the next difference in the index:
+//
+// Starts a new index if we don't have one that covers pos.
+//
+// Input:
+//   pos:  The position in file1 to start looking
+//
+// Output:
+//   diff:  See DiffIndex::findNext
+//
+// Returns:
+//   1 if a difference was found
+//   0 if there are no more differences
+//  -1 if the files can't be indexed (so they must be scanned)
+
+int indexedDiff(FPos pos, FPos& diff)
+{
+  if (singleFile || !DiffIndex::canIndex(file1, file2))
+    return -1;
+
+  const FPos  phase = file2.getOffset() - file1.getOffset();
+
+  if (!diffIndex || !diffIndex->covers(pos, phase)) {
+    delete diffIndex;
+    diffIndex = new DiffIndex(&file1, &file2, pos);
+  }
+
+  return diffIndex->findNext(pos, diff);
+} // end indexedDiff
+
+//--------------------------------------------------------------------
+// Look up the previous difference in the index:
+//
+// Unlike indexedDiff, this doesn't start a new index, because an
+// index can only look forwards from where it started.
+//
+// Input:
+//   pos:  The position in file1 to look before
+//
+// Output:
+//   diff:  See DiffIndex::findPrevious
+//
+// Returns:
+//   1 if a difference was found
+//   0 if there are no differences before pos
+//  -1 if the index can't tell us (so we must scan back from diff)
+
+int indexedPrevDiff(FPos pos, FPos& diff)
+{
+  if (singleFile || !diffIndex || !DiffIndex::canIndex(file1, file2))
+    return -1;
+
+  if (!diffIndex->covers(pos, file2.getOffset() - file1.getOffset()))
+    return -1;
+
+  return diffIndex->findPrevious(pos, diff);
+} // end indexedPrevDiff
+
 //--------------------------------------------------------------------
 // Get a file position and move there:
 
@@ -1559,7 +6828,7 @@ void gotoPosition(Command cmd)
   if (!buf[0])
     return;
 
-  FPos  pos = strtoul(buf, NULL, 16);
+  FPos  pos = FPos(strtoull(buf, NULL, 16));
 
   if (cmd & cmgGotoTop)
     file1.moveTo(pos);
@@ -1635,6 +6904,228 @@ void searchFiles(Command cmd)
   if (problem) beep();
 } // end searchFiles
 
+//--------------------------------------------------------------------
+// Tell the user something went wrong:
+//
+// Input:
+//   message:  The message to display (it should end by asking for a key)
+
+void reportError(const char* message)
+{
+  promptWin.clear();
+  promptWin.border();
+  promptWin.put((screenWidth - strlen(message)) / 2, 1, message);
+  promptWin.update();
+  promptWin.readKey();
+  showPrompt();
+} // end reportError
+
+//--------------------------------------------------------------------
+// Copy, write out, or fill a range of a file:
+//
+// These work directly on the file, without going through edits (so
+// they can't be undone), which lets them handle any amount of data.
+
+void rangeCommand(Command cmd)
+{
+  FileDisplay&  target = ((cmd & cmgGotoTop) ? file1 : file2);
+  FileDisplay&  other  = ((cmd & cmgGotoTop) ? file2 : file1);
+
+  positionInWin(cmd, (singleFile ? 28 : 53), " Range ");
+
+  inWin.put(2, 1,"F Fill   W Write to file");
+  inWin.putAttribs( 2,1, cPromptKey, 1);
+  inWin.putAttribs(11,1, cPromptKey, 1);
+  if (!singleFile) {
+    inWin.put(29, 1,"C Copy from other file");
+    inWin.putAttribs(29,1, cPromptKey, 1);
+  }
+  inWin.update();
+  const int key = safeUC(inWin.readKey());
+
+  if (key != 'F' && key != 'W' && (key != 'C' || singleFile)) {
+    inWin.hide();
+    return;
+  }
+
+  const int  maxLen = inWidth-2;
+  char  buf[screenWidth-3];
+
+  positionInWin(cmd, inWidth+2, " Start ");
+  getString(buf, maxLen, positionHistory, hexDigits, true);
+  if (!buf[0]) return;
+  const FPos  start = FPos(strtoull(buf, NULL, 16));
+
+  positionInWin(cmd, inWidth+2, " Length ");
+  getString(buf, maxLen, positionHistory, hexDigits, true);
+  if (!buf[0]) return;
+  const FPos  length = FPos(strtoull(buf, NULL, 16));
+
+  if (start < 0 || length <= 0 ||
+      length > numeric_limits<FPos>::max() - start) {
+    beep();
+    return;
+  }
+
+  if (key != 'W' && target.hasEdits(start, length)) {
+    reportError("Save or undo your changes there first.  Press any key.");
+    return;
+  }
+
+  bool  ok;
+
+  if (key == 'C')
+    ok = target.copyFrom(other, start, length);
+  else if (key == 'F') {
+    positionInWin(cmd, screenWidth, " Fill with Hex Bytes ");
+    getString(buf, screenWidth-4, hexSearchHistory, hexDigits, true, true);
+    const int  patternLen = packHex(reinterpret_cast<Byte*>(buf));
+    if (!patternLen) return;
+
+    ok = target.fill(start, length, reinterpret_cast<Byte*>(buf),
+                     patternLen);
+  } else {
+    positionInWin(cmd, screenWidth, " Write to File ");
+    getString(buf, screenWidth-4, fileNameHistory);
+    if (!buf[0]) return;
+
+    File  out = OpenNewFile(buf);
+    ok = (out != InvalidFile && target.copyTo(out, 0, start, length));
+    if (out != InvalidFile) CloseFile(out);
+  } // end else writing to a file
+
+  if (!ok)
+    reportError("Unable to complete the operation.  Press any key.");
+} // end rangeCommand
+
+//--------------------------------------------------------------------
+// Undo or redo an edit session:
+//
+// Input:
+//   from:  The list to take the most recent session from
+//   to:    The list to put it on afterwards
+//   undo:  True means undo the session, false means redo it
+
+void replayEdit(vector<ChangeVec>& from, vector<ChangeVec>& to, bool undo)
+{
+  if (from.empty()) {
+    beep();
+    return;
+  }
+
+  const ChangeVec&  changes = from.back();
+
+  if (undo) {
+    for (ChangeVec::const_reverse_iterator c = changes.rbegin();
+         c != changes.rend(); ++c)
+      c->file->setEdit(c->pos, c->before);
+  } else {
+    for (ChangeVec::const_iterator c = changes.begin();
+         c != changes.end(); ++c)
+      c->file->setEdit(c->pos, c->after);
+  }
+
+  to.push_back(changes);
+  from.pop_back();
+
+  file1.move(0);                // Re-read the buffers
+  file2.move(0);
+} // end replayEdit
+
+//--------------------------------------------------------------------
+// Write all unsaved changes to the files:
+//
+// Once saved, changes can't be undone.
+//
+// Returns:
+//   true:   Everything was saved
+//   false:  An error occurred (the error has been displayed)
+
+bool saveChanges()
+{
+  const bool  ok1 = file1.save();
+  const bool  ok2 = file2.save();
+
+  undoList.clear();
+  redoList.clear();
+
+  if (ok1 && ok2) return true;
+
+  reportError("Unable to save changes.  Press any key.");
+
+  return false;
+} // end saveChanges
+
+//--------------------------------------------------------------------
+// Ask the user a question:
+//
+// Input:
+//   question:  The question to ask (it should end with "(Y/N):")
+//
+// Returns:
+//   true if the answer was Y
+
+bool askYesNo(const char* question)
+{
+  const short  x = short((screenWidth - strlen(question)) / 2);
+
+  promptWin.clear();
+  promptWin.border();
+  promptWin.put(x,1, question);
+  promptWin.update();
+  promptWin.setCursor(x + short(strlen(question)) + 1, 1);
+  ConWindow::showCursor();
+  const int  key = safeUC(promptWin.readKey());
+  ConWindow::hideCursor();
+  showPrompt();
+
+  return (key == 'Y');
+} // end askYesNo
+
+//--------------------------------------------------------------------
+// Make sure unsaved changes aren't lost when quitting:
+//
+// Returns:
+//   true:   OK to quit
+//   false:  Don't quit
+
+bool okToQuit()
+{
+  if (!file1.isModified() && !file2.isModified()) return true;
+
+  promptWin.clear();
+  promptWin.border();
+  promptWin.put(20,1, "Save changes before quitting (Y/N/ESC):");
+  promptWin.update();
+  promptWin.setCursor(60,1);
+  ConWindow::showCursor();
+  const int  key = safeUC(promptWin.readKey());
+  ConWindow::hideCursor();
+  showPrompt();
+
+  if (key == 'Y') return saveChanges();
+
+  return (key == 'N');
+} // end okToQuit
+
+//--------------------------------------------------------------------
+// Widen the offset column if the files need it:
+//
+// The column never gets narrower, so the display doesn't jump around.
+
+void updateOffsetWidth()
+{
+  const FPos  last = max(file1.lastOffset(), file2.lastOffset());
+
+  while (offsetDigits < maxOffsetDigits && (last >> (4 * offsetDigits)))
+    ++offsetDigits;
+
+  // The offset column, then a space:
+  leftMar  = ((offsetDigits == minOffsetDigits) ? 11 :
+              offsetDigits + ((offsetDigits < maxOffsetDigits) ? 2 : 1));
+  leftMar2 = leftMar + 50;
+} // end updateOffsetWidth
+
 //--------------------------------------------------------------------
 // Handle a command:
 //
@@ -1644,7 +7135,7 @@ void searchFiles(Command cmd)
 void handleCmd(Command cmd)
 {
   if (cmd & cmmMove) {
-    int  step = steps[cmd & cmmMoveSize];
+    FPos  step = steps[cmd & cmmMoveSize];
 
     if ((cmd & cmmMoveForward) == 0)
       step *= -1;               // We're moving backward
@@ -1679,11 +7170,78 @@ void handleCmd(Command cmd)
       lockState = lockNeither;
       displayLockState();
     }
-    do {
-      file1.move(bufSize);
-      file2.move(bufSize);
-    } while (!diffs.compute());
+    if (file2.isPattern()) {
+      // Jump straight to the page before the next difference:
+      const FPos  pos  = file1.getOffset() + bufSize;
+      FPos        skip = file1.matchPattern(pos, againstPattern,
+                                            file2.getOffset() -
+                                            file1.getOffset()) - pos;
+      skip -= skip % bufSize;
+      file1.move(skip);
+      file2.move(skip);
+    } // end if comparing with a pattern
+
+    // Find the next difference past the screen, using the index if
+    // the files can be indexed, and move so it's on the top line.
+    // If there are no more, move past the end.  (The index doesn't
+    // know about unreadable sectors, so make sure there's really a
+    // difference on the screen.)
+    bool  found = false;
+
+    while (!found) {
+      FPos  diff  = file1.getOffset() + bufSize;
+      int   known = indexedDiff(diff, diff);
+
+      if (known < 0)
+        known = file1.findDifference(file2, diff);
+
+      FPos  skip = diff - file1.getOffset();
+      if (known)
+        skip -= skip % lineWidth; // The line with the difference
+      else
+        skip = (skip + bufSize - 1) / bufSize * bufSize; // Past the end
+
+      file1.move(max(skip, FPos(bufSize)));
+      file2.move(max(skip, FPos(bufSize)));
+      found = (diffs.compute() != 0);
+    } // end while no difference found
+    file1.stopReadahead();
+    file2.stopReadahead();
   } // end else if cmNextDiff
+  else if (cmd == cmPrevDiff) {
+    if (lockState) {
+      lockState = lockNeither;
+      displayLockState();
+    }
+
+    // Find the last difference before the screen, and move so it's
+    // on the bottom line.  If there are none, move to where both
+    // files begin.
+    const FPos  begin = (singleFile ? 0 : max(FPos(0), file1.getOffset() -
+                                                       file2.getOffset()));
+    bool  found = false;
+
+    while (!found) {
+      const FPos  top   = file1.getOffset();
+      FPos        diff  = top;
+      int         known = indexedPrevDiff(diff, diff);
+
+      if (known < 0)
+        known = file1.findPrevDifference(file2, diff);
+
+      FPos  skip = diff - top;
+      if (known) {
+        skip -= lineWidth - 1;  // The line with the difference
+        skip -= skip % lineWidth;
+        skip -= bufSize - lineWidth;
+      }
+
+      skip = max(skip, begin - top);
+      file1.move(skip);
+      file2.move(skip);
+      found = (!known || file1.getOffset() == top || diffs.compute() != 0);
+    } // end while no difference found
+  } // end else if cmPrevDiff
   else if (cmd == cmUseTop) {
     if (lockState == lockBottom)
       lockState = lockNeither;
@@ -1708,6 +7266,14 @@ void handleCmd(Command cmd)
     file1.edit(singleFile ? NULL : &file2);
   else if (cmd == cmEditBottom)
     file2.edit(&file1);
+  else if (cmd == cmUndo)
+    replayEdit(undoList, redoList, true);
+  else if (cmd == cmRedo)
+    replayEdit(redoList, undoList, false);
+  else if (cmd == cmSave)
+    saveChanges();
+  else if ((cmd & cmgGotoMask) == cmRange)
+    rangeCommand(cmd);
 
   // Make sure we haven't gone past the end of both files:
   while (diffs.compute() < 0) {
@@ -1715,6 +7281,7 @@ void handleCmd(Command cmd)
     file2.move(-steps[cmmMovePage]);
   }
 
+  updateOffsetWidth();
   file1.display();
   file2.display();
 } // end handleCmd
@@ -1747,6 +7314,167 @@ bool license(GetOpt*, const GetOpt::Option*, const char*,
   return false;                 // Never happens
 } // end license
 
+//--------------------------------------------------------------------
+// Set the size of the block cache:
+
+bool setCacheSize(GetOpt*, const GetOpt::Option*, const char*,
+                  GetOpt::Connection, const char* arg, int*)
+{
+  char*  end = NULL;
+  long   val = (arg ? strtol(arg, &end, 10) : -1);
+
+  if (val < 0 || val > INT_MAX / 1024 || end == arg || *end) {
+    cerr << program_name << ": invalid cache size `"
+         << (arg ? arg : "") << "'\n";
+    usage(false, 2);
+  }
+
+  cacheSize = int(val);
+
+  return true;                  // We used the argument
+} // end setCacheSize
+
+//--------------------------------------------------------------------
+// Set the number of threads used to compare files:
+
+bool setThreads(GetOpt*, const GetOpt::Option*, const char*,
+                GetOpt::Connection, const char* arg, int*)
+{
+  char*  end = NULL;
+  long   val = (arg ? strtol(arg, &end, 10) : -1);
+
+  if (val < 1 || val > 1024 || end == arg || *end) {
+    cerr << program_name << ": invalid number of threads `"
+         << (arg ? arg : "") << "'\n";
+    usage(false, 2);
+  }
+
+  scanThreads = int(val);
+
+  return true;                  // We used the argument
+} // end setThreads
+
+//--------------------------------------------------------------------
+// Keep the hashes of files' blocks in a directory:
+
+bool setHashCache(GetOpt*, const GetOpt::Option*, const char*,
+                  GetOpt::Connection, const char* arg, int*)
+{
+  if (!arg || !*arg) {
+    cerr << program_name << ": --hash-cache needs a directory\n";
+    usage(false, 2);
+  }
+
+  hashCacheDir = arg;
+
+  return true;                  // We used the argument
+} // end setHashCache
+
+//--------------------------------------------------------------------
+// Set the I/O policy for scans:
+
+bool setIOPolicy(GetOpt*, const GetOpt::Option*, const char*,
+                 GetOpt::Connection, const char* arg, int*)
+{
+  if (arg && !strcmp(arg, "normal"))
+    ioPolicy = ioNormal;
+  else if (arg && !strcmp(arg, "sequential"))
+    ioPolicy = ioSequential;
+  else if (arg && !strcmp(arg, "direct"))
+    ioPolicy = ioDirect;
+  else {
+    cerr << program_name << ": invalid I/O policy `"
+         << (arg ? arg : "") << "'\n";
+    usage(false, 2);
+  }
+
+  return true;                  // We used the argument
+} // end setIOPolicy
+
+//--------------------------------------------------------------------
+// Back up files before changing them:
+
+bool setBackup(GetOpt*, const GetOpt::Option*, const char*,
+               GetOpt::Connection, const char*, int*)
+{
+  makeBackups = true;
+
+  return false;                 // We didn't use an argument
+} // end setBackup
+
+//--------------------------------------------------------------------
+// Display compressed files as they are:
+
+bool setNoDecompress(GetOpt*, const GetOpt::Option*, const char*,
+                     GetOpt::Connection, const char*, int*)
+{
+  decompress = false;
+
+  return false;                 // We didn't use an argument
+} // end setNoDecompress
+
+//--------------------------------------------------------------------
+// Compare FILE1 with a repeated pattern:
+
+bool setAgainstPattern(GetOpt*, const GetOpt::Option*, const char*,
+                       GetOpt::Connection, const char* arg, int*)
+{
+  String  digits;
+  bool    valid = (arg != NULL);
+
+  for (const char* c = arg; valid && *c; ++c)
+    if (isxdigit(Byte(*c)))
+      digits += *c;
+    else if (*c != ' ')
+      valid = false;
+
+  if (!valid || digits.empty() || digits.size() % 2) {
+    cerr << program_name << ": invalid pattern `"
+         << (arg ? arg : "") << "'\n";
+    usage(false, 2);
+  }
+
+  againstPattern.clear();
+
+  for (String::size_type i = 0; i < digits.size(); i += 2)
+    againstPattern += char(strtoul(digits.substr(i, 2).c_str(), NULL, 16));
+
+  return true;                  // We used the argument
+} // end setAgainstPattern
+
+//--------------------------------------------------------------------
+// Read around unreadable sectors:
+
+bool setTolerateErrors(GetOpt*, const GetOpt::Option*, const char*,
+                       GetOpt::Connection, const char*, int*)
+{
+  tolerateErrors = true;
+
+  return false;                 // We didn't use an argument
+} // end setTolerateErrors
+
+//--------------------------------------------------------------------
+// Display split images one segment at a time:
+
+bool setNoJoin(GetOpt*, const GetOpt::Option*, const char*,
+               GetOpt::Connection, const char*, int*)
+{
+  joinSplits = false;
+
+  return false;                 // We didn't use an argument
+} // end setNoJoin
+
+//--------------------------------------------------------------------
+// Keep everything read from a pipe:
+
+bool setSpill(GetOpt*, const GetOpt::Option*, const char*,
+              GetOpt::Connection, const char*, int*)
+{
+  spillStreams = true;
+
+  return false;                 // We didn't use an argument
+} // end setSpill
+
 //--------------------------------------------------------------------
 // Display version & usage information and exit:
 //
@@ -1765,10 +7493,28 @@ void usage(bool showHelp, int exitStatus)
       cout << "Usage: " << program_name << " FILE1 [FILE2]\n\
 Compare FILE1 and FILE2 byte by byte.\n\
 If FILE2 is omitted, just display FILE1.\n\
+Either file may be - (standard input) or a pipe.\n\
+Files compressed with gzip or zstd are displayed uncompressed.\n\
+A split image (FILE.001, FILE.002, ...) is displayed as one file.\n\
+Either file may be pid:NUMBER to display the memory of a running process.\n\
 \n\
 Options:\n\
+      --against-pattern=HEX\n\
+                           compare FILE1 with HEX bytes repeated over and over\n\
+      --backup             copy each file to FILE~ before changing it\n\
+      --cache-size=MB      cache this much of each file in memory (default 16)\n\
+      --hash-cache=DIR     keep hashes of each file's blocks in DIR, so\n\
+                           comparing the same files again reads less\n\
       --help               display this help information and exit\n\
+      --io-policy=POLICY   how searches use the OS cache: normal, sequential\n\
+                           (discard what's been scanned) or direct (bypass it)\n\
       -L, --license        display license & warranty information and exit\n\
+      --no-decompress      display compressed files without decompressing them\n\
+      --no-join            display FILE.001 alone, not joined with FILE.002...\n\
+      --spill              save data read from pipes in a temporary file,\n\
+                           so you can move back to any part of it\n\
+      --threads=N          compare files with N threads (default 1 per CPU)\n\
+      --tolerate-errors    show unreadable sectors as ?? and keep going\n\
       -V, --version        display version information and exit\n";
   }
 
@@ -1797,9 +7543,19 @@ void processOptions(int& argc, char**& argv)
 {
   static const GetOpt::Option options[] =
   {
-    { '?', "help",       NULL, 0, &usage },
-    { 'L', "license",    NULL, 0, &license },
-    { 'V', "version",    NULL, 0, &usage },
+    { 0,   "against-pattern",NULL, 0, &setAgainstPattern },
+    { 0,   "backup",         NULL, 0, &setBackup },
+    { 0,   "cache-size",     NULL, 0, &setCacheSize },
+    { 0,   "hash-cache",     NULL, 0, &setHashCache },
+    { '?', "help",           NULL, 0, &usage },
+    { 0,   "io-policy",      NULL, 0, &setIOPolicy },
+    { 'L', "license",        NULL, 0, &license },
+    { 0,   "no-decompress",  NULL, 0, &setNoDecompress },
+    { 0,   "no-join",        NULL, 0, &setNoJoin },
+    { 0,   "spill",          NULL, 0, &setSpill },
+    { 0,   "threads",        NULL, 0, &setThreads },
+    { 0,   "tolerate-errors",NULL, 0, &setTolerateErrors },
+    { 'V', "version",        NULL, 0, &usage },
     { 0 }
   };
 
@@ -1829,14 +7585,27 @@ int main(int argc, char* argv[])
 
   processOptions(argc, argv);
 
-  if (argc < 2 || argc > 3)
+  if (argc < 2 || argc > (againstPattern.empty() ? 3 : 2))
     usage(1);
 
   cout << "\
 VBinDiff " PACKAGE_VERSION ", Copyright 1995-2017 Christopher J. Madsen\n\
 VBinDiff comes with ABSOLUTELY NO WARRANTY; for details type `vbindiff -L'.\n";
 
-  singleFile = (argc == 2);
+  singleFile = (argc == 2 && againstPattern.empty());
+
+  // Standard input has to be taken over before curses starts:
+  File  stdinFile = InvalidFile;
+
+  if (!strcmp(argv[1], "-") || (argc == 3 && !strcmp(argv[2], "-"))) {
+    stdinFile = OpenStdin();
+    if (stdinFile == InvalidFile) {
+      cerr << '\n' << program_name << ": Unable to read standard input: "
+           << ErrorMsg() << '\n';
+      return 1;
+    }
+  } // end if reading standard input
+
   if (!initialize()) {
     cerr << '\n' << program_name << ": Unable to initialize windows\n";
     return 1;
@@ -1845,11 +7614,19 @@ VBinDiff comes with ABSOLUTELY NO WARRANTY; for details type `vbindiff -L'.\n";
   {
     ostringstream errMsg;
 
-    if (!file1.setFile(argv[1])) {
+    const bool  stdin1 = !strcmp(argv[1], "-");
+
+    if (argc == 3 && stdin1 && !strcmp(argv[2], "-"))
+      errMsg << "You can only read standard input once";
+    else if (!file1.setFile(argv[1], (stdin1 ? stdinFile : InvalidFile))) {
       const char* errStr = ErrorMsg();
       errMsg << "Unable to open " << argv[1] << ": " << errStr;
     }
-    else if (!singleFile && !file2.setFile(argv[2])) {
+    else if (!againstPattern.empty())
+      file2.setPattern(againstPattern,
+                       (file1.isStream() ? -1 : file1.getSize()));
+    else if (!singleFile &&
+             !file2.setFile(argv[2], (stdin1 ? InvalidFile : stdinFile))) {
       const char* errStr = ErrorMsg();
       errMsg << "Unable to open " << argv[2] << ": " << errStr;
     }
@@ -1860,12 +7637,15 @@ VBinDiff comes with ABSOLUTELY NO WARRANTY; for details type `vbindiff -L'.\n";
 
   diffs.compute();
 
+  updateOffsetWidth();
   file1.display();
   file2.display();
 
   Command  cmd;
-  while ((cmd = getCommand()) != cmQuit)
-    handleCmd(cmd);
+  while ((cmd = getCommand()) != cmQuit || !okToQuit())
+    if (cmd != cmQuit) handleCmd(cmd);
+
+  delete diffIndex;
 
   file1.shutDown();
   file2.shutDown();
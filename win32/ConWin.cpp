@@ -34,6 +34,7 @@ void exitMsg(int status, const char* message); // From vbindiff.cpp
 #define F_WHITE (FOREGROUND_RED|FOREGROUND_GREEN|FOREGROUND_BLUE)
 #define F_YELLOW (FOREGROUND_GREEN|FOREGROUND_RED)
 #define B_BLUE  BACKGROUND_BLUE
+#define B_RED   BACKGROUND_RED
 #define B_WHITE (BACKGROUND_RED|BACKGROUND_GREEN|BACKGROUND_BLUE)
 
 static const WORD colorStyle[] = {
@@ -45,7 +46,8 @@ static const WORD colorStyle[] = {
   F_BLACK|B_WHITE,                      // cFileName
   F_WHITE|B_BLUE,                       // cFileWin
   F_RED|B_BLUE|FOREGROUND_INTENSITY,    // cFileDiff
-  F_YELLOW|B_BLUE|FOREGROUND_INTENSITY  // cFileEdit
+  F_YELLOW|B_BLUE|FOREGROUND_INTENSITY, // cFileEdit
+  F_WHITE|B_RED|FOREGROUND_INTENSITY    // cFileBad
 };
 
 //====================================================================
@@ -48,7 +48,8 @@ enum Style {
   cFileName,
   cFileWin,
   cFileDiff,
-  cFileEdit
+  cFileEdit,
+  cFileBad
 };
 
 class ConWindow
@@ -23,6 +23,8 @@
 
 #define INCLUDED_FILEIO_HPP
 
+#include <new>
+
 typedef HANDLE   File;
 typedef __int64  FPos;
 typedef int      Size;
@@ -33,6 +35,22 @@ const DWORD
 
 const File InvalidFile = INVALID_HANDLE_VALUE;
 
+typedef HANDLE   Process;
+
+const Process InvalidProcess = NULL;
+
+struct MemoryMap                // The list of a process's regions
+{
+  Process  process;
+  SIZE_T   next;                // Where to start looking
+}; // end MemoryMap
+
+// Buffers used with OpenFileDirect must be aligned to this:
+const Size DirectAlignment = 4096;
+
+// Hints for AdviseFile and AdviseMapping:
+enum Advice { AdviseNormal, AdviseSequential, AdviseDontNeed };
+
 #ifndef INVALID_SET_FILE_POINTER
 #define INVALID_SET_FILE_POINTER ((DWORD)0xFFFFFFFF)
 #endif
@@ -55,6 +73,79 @@ inline File OpenFile(const char* path, bool writable=false)
                     NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 } // end OpenFile
 
+//--------------------------------------------------------------------
+// Open a file for reading without going through the OS cache:
+//
+// Reads must use buffers, positions and sizes that are multiples of
+// the sector size (DirectAlignment covers any common disk).
+
+inline File OpenFileDirect(const char* path)
+{
+  return CreateFile(path, GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE,
+                    NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+} // end OpenFileDirect
+
+//--------------------------------------------------------------------
+// Take over standard input as a file to display:
+//
+// The console reads keyboard input through standard input, so this
+// isn't supported.
+
+inline File OpenStdin()
+{
+  SetLastError(ERROR_NOT_SUPPORTED);
+  return InvalidFile;
+} // end OpenStdin
+
+//--------------------------------------------------------------------
+// Create an anonymous temporary file:
+//
+// The file is deleted when it's closed.
+
+File OpenTempFile()
+{
+  TCHAR  dir[MAX_PATH], path[MAX_PATH];
+
+  if (!GetTempPath(MAX_PATH, dir) || !GetTempFileName(dir, TEXT("vbd"), 0, path))
+    return InvalidFile;
+
+  return CreateFile(path, GENERIC_READ|GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE, NULL);
+} // end OpenTempFile
+
+//--------------------------------------------------------------------
+// Create a file for writing:
+//
+// Input:
+//   path:       The file to create
+//   exclusive:  If true, fail if the file already exists.
+//               Otherwise, replace any existing file.
+
+inline File OpenNewFile(const char* path, bool exclusive=false)
+{
+  return CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                    (exclusive ? CREATE_NEW : CREATE_ALWAYS),
+                    FILE_ATTRIBUTE_NORMAL, NULL);
+} // end OpenNewFile
+
+//--------------------------------------------------------------------
+// Find out whether OpenNewFile failed because the file exists:
+
+inline bool FileExisted()
+{
+  return (GetLastError() == ERROR_FILE_EXISTS);
+} // end FileExisted
+
+//--------------------------------------------------------------------
+// Give a file the same permissions as another:
+//
+// A new file inherits its permissions from its directory, so there's
+// nothing to do.
+
+inline void CopyFileMode(File, File)
+{
+} // end CopyFileMode
+
 //--------------------------------------------------------------------
 inline void CloseFile(File file)
 {
@@ -95,6 +186,366 @@ FPos SeekFile(File file, FPos position, DWORD whence=SeekPos)
    return li.QuadPart;
 } // end SeekFile
 
+//--------------------------------------------------------------------
+// Read from a specific position:
+//
+// Unlike SeekFile+ReadFile, this doesn't depend on the file pointer,
+// so several threads can read the same file at once.
+
+Size ReadFileAt(File file, FPos position, void* buffer, Size count)
+{
+  OVERLAPPED  ov = { 0 };
+  DWORD       bytesRead;
+
+  ov.Offset     = DWORD(position);
+  ov.OffsetHigh = DWORD(position >> 32);
+
+  if (!ReadFile(file, buffer, count, &bytesRead, &ov))
+    return ((GetLastError() == ERROR_HANDLE_EOF) ? 0 : -1);
+
+  return bytesRead;
+} // end ReadFileAt
+
+//--------------------------------------------------------------------
+// Write to a specific position:
+
+bool WriteFileAt(File file, FPos position, const void* buffer, Size count)
+{
+  OVERLAPPED  ov = { 0 };
+  DWORD       bytesWritten;
+
+  ov.Offset     = DWORD(position);
+  ov.OffsetHigh = DWORD(position >> 32);
+
+  return (WriteFile(file, buffer, count, &bytesWritten, &ov) != 0
+          && bytesWritten == DWORD(count));
+} // end WriteFileAt
+
+//--------------------------------------------------------------------
+// Make one file a copy-on-write clone of another:
+//
+// Only ReFS supports block cloning, and it needs the files to be
+// set up with matching cluster alignment, so we always copy.
+
+inline bool CloneFile(File, File)
+{
+  return false;
+} // end CloneFile
+
+//--------------------------------------------------------------------
+// Copy part of one file into another:
+//
+// Returns:
+//   The number of bytes copied (0 at EOF), or -1 on error
+
+Size CopyFileRange(File from, FPos fromPos, File to, FPos toPos, Size count)
+{
+  char  buf[65536];
+
+  if (count > Size(sizeof(buf))) count = sizeof(buf);
+
+  Size  bytesRead = ReadFileAt(from, fromPos, buf, count);
+
+  if (bytesRead > 0 && !WriteFileAt(to, toPos, buf, bytesRead))
+    return -1;
+
+  return bytesRead;
+} // end CopyFileRange
+
+//--------------------------------------------------------------------
+// Check whether we can read a file in any order:
+//
+// Returns false for pipes and character devices.
+
+inline bool IsSeekable(File file)
+{
+  return (GetFileType(file) == FILE_TYPE_DISK);
+} // end IsSeekable
+
+//--------------------------------------------------------------------
+// Get the size of a file:
+//
+// Returns:
+//   The file size, or -1 if it can't be determined
+
+FPos FileSize(File file)
+{
+  LARGE_INTEGER li;
+
+  if (!GetFileSizeEx(file, &li)) return -1;
+
+  return li.QuadPart;
+} // end FileSize
+
+//--------------------------------------------------------------------
+// Find out whether a position is in a hole in a sparse file:
+//
+// A hole reads as zeros, but takes up no space on disk.
+//
+// Input:
+//   pos:  The position to check
+//
+// Output:
+//   end:
+//     If pos is in a hole, the position where the hole ends
+//     Otherwise, the position where the data ends,
+//     or -1 if the OS can't tell us
+//
+// Returns:
+//   true:   pos is in a hole
+//   false:  pos is in data, past EOF, or holes aren't supported
+
+bool FindHole(File file, FPos pos, FPos& end)
+{
+  const FPos  size = FileSize(file);
+
+  end = -1;
+  if (size < 0 || pos >= size) return false;
+
+  FILE_ALLOCATED_RANGE_BUFFER  query, range;
+  DWORD                        bytes;
+
+  query.FileOffset.QuadPart = pos;
+  query.Length.QuadPart     = size - pos;
+
+  if (!DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES,
+                       &query, sizeof(query), &range, sizeof(range),
+                       &bytes, NULL) &&
+      GetLastError() != ERROR_MORE_DATA)
+    return false;               // Not supported
+
+  if (bytes < sizeof(range)) {
+    end = size;                 // The rest of the file is a hole
+    return true;
+  }
+
+  if (range.FileOffset.QuadPart > pos) {
+    end = range.FileOffset.QuadPart;
+    return true;
+  }
+
+  end = range.FileOffset.QuadPart + range.Length.QuadPart;
+
+  return false;
+} // end FindHole
+
+//--------------------------------------------------------------------
+// Map an entire file into memory for reading:
+//
+// Returns NULL if the file can't be mapped (e.g. it's empty or too
+// large for the address space); the caller should use ReadFile.
+//
+// Output:
+//   size:  The number of bytes mapped
+
+const void* MapFile(File file, FPos& size)
+{
+  LARGE_INTEGER li;
+
+  if (!GetFileSizeEx(file, &li) || li.QuadPart <= 0 ||
+      FPos(SIZE_T(li.QuadPart)) != li.QuadPart)
+    return NULL;
+
+  HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapping) return NULL;
+
+  // The view keeps the mapping object alive:
+  const void* p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+
+  if (p) size = li.QuadPart;
+  return p;
+} // end MapFile
+
+//--------------------------------------------------------------------
+inline void UnmapFile(const void* address, FPos)
+{
+  UnmapViewOfFile(address);
+} // end UnmapFile
+
+//--------------------------------------------------------------------
+// Get the time a file was last modified:
+//
+// Returns:
+//   The modification time (in arbitrary units), or -1 on error
+
+FPos FileModTime(File file)
+{
+  FILETIME  ft;
+
+  if (!GetFileTime(file, NULL, NULL, &ft)) return -1;
+
+  return (FPos(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+} // end FileModTime
+
+//--------------------------------------------------------------------
+// Get the time a file's contents or attributes last changed:
+//
+// Unlike the modification time, this can't be set back.  (Before
+// Vista, Windows doesn't keep it, so we use the modification time.)
+//
+// Returns:
+//   The change time (in arbitrary units), or -1 on error
+
+FPos FileChangeTime(File file)
+{
+#if _WIN32_WINNT >= 0x0600
+  FILE_BASIC_INFO  info;
+
+  if (!GetFileInformationByHandleEx(file, FileBasicInfo, &info, sizeof(info)))
+    return -1;
+
+  return info.ChangeTime.QuadPart;
+#else
+  return FileModTime(file);
+#endif
+} // end FileChangeTime
+
+//--------------------------------------------------------------------
+// Identify a file:
+//
+// Output:
+//   device:  The volume the file is on
+//   inode:   The file's number on that volume
+//
+// Returns:
+//   true if the file could be identified
+
+bool FileId(File file, FPos& device, FPos& inode)
+{
+  BY_HANDLE_FILE_INFORMATION  info;
+
+  if (!GetFileInformationByHandle(file, &info)) return false;
+
+  device = info.dwVolumeSerialNumber;
+  inode  = (FPos(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+
+  return true;
+} // end FileId
+
+//--------------------------------------------------------------------
+// Allocate a buffer suitable for a file opened with OpenFileDirect:
+
+inline void* AllocBuffer(Size size)
+{
+  void*  p = _aligned_malloc(size, DirectAlignment);
+
+  if (!p) throw std::bad_alloc();
+
+  return p;
+} // end AllocBuffer
+
+//--------------------------------------------------------------------
+inline void FreeBuffer(void* buffer)
+{
+  _aligned_free(buffer);
+} // end FreeBuffer
+
+//--------------------------------------------------------------------
+// Tell the OS how we're going to use part of a file:
+//
+// Windows has no equivalent of posix_fadvise, so these do nothing.
+
+inline void AdviseFile(File, FPos, FPos, Advice)
+{
+} // end AdviseFile
+
+inline void AdviseMapping(const void*, FPos, Advice)
+{
+} // end AdviseMapping
+
+//--------------------------------------------------------------------
+// Get ready to read another process's memory:
+//
+// Returns:
+//   The process, or InvalidProcess if it doesn't exist or we aren't
+//   allowed to look at it (call ErrorMsg for the reason)
+
+inline Process OpenProcessMemory(long pid)
+{
+  return OpenProcess(PROCESS_VM_READ|PROCESS_QUERY_INFORMATION, FALSE,
+                     DWORD(pid));
+} // end OpenProcessMemory
+
+//--------------------------------------------------------------------
+inline void CloseProcessMemory(Process process)
+{
+  CloseHandle(process);
+} // end CloseProcessMemory
+
+//--------------------------------------------------------------------
+// Read another process's memory:
+//
+// Returns:
+//   The number of bytes read, or -1 if an error occurred
+
+Size ReadProcessAt(Process process, FPos address, void* buffer, Size count)
+{
+  SIZE_T  bytesRead = 0;
+
+  if (!ReadProcessMemory(process, reinterpret_cast<LPCVOID>(SIZE_T(address)),
+                         buffer, count, &bytesRead) &&
+      GetLastError() != ERROR_PARTIAL_COPY)
+    return -1;
+
+  return Size(bytesRead);
+} // end ReadProcessAt
+
+//--------------------------------------------------------------------
+// Start listing the readable regions of another process's memory:
+//
+// Output:
+//   map:  Pass this to NextMemoryRegion, then to CloseMemoryMap
+//
+// Returns:
+//   false if the list couldn't be read (call ErrorMsg for the reason)
+
+inline bool OpenMemoryMap(Process process, MemoryMap& map)
+{
+  map.process = process;
+  map.next    = 0;
+
+  return true;
+} // end OpenMemoryMap
+
+//--------------------------------------------------------------------
+inline void CloseMemoryMap(MemoryMap)
+{
+} // end CloseMemoryMap
+
+//--------------------------------------------------------------------
+// Find the next readable region of another process's memory:
+//
+// Regions are returned in order of address.
+//
+// Output:
+//   start, end:  The region found
+//
+// Returns:
+//   false if there are no more readable regions
+
+bool NextMemoryRegion(MemoryMap& map, FPos& start, FPos& end)
+{
+  MEMORY_BASIC_INFORMATION  mbi;
+
+  while (VirtualQueryEx(map.process, reinterpret_cast<LPCVOID>(map.next),
+                        &mbi, sizeof(mbi)) == sizeof(mbi)) {
+    const SIZE_T  next = SIZE_T(mbi.BaseAddress) + mbi.RegionSize;
+
+    if (next <= map.next) break; // Wrapped around
+    map.next = next;
+
+    if (mbi.State == MEM_COMMIT &&
+        !(mbi.Protect & (PAGE_NOACCESS|PAGE_GUARD))) {
+      start = FPos(SIZE_T(mbi.BaseAddress));
+      end   = FPos(next);
+      return true;
+    }
+  } // end while more regions
+
+  return false;
+} // end NextMemoryRegion
+
 #endif // INCLUDED_FILEIO_HPP
 
 // Local Variables: